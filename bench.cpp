@@ -1,11 +1,22 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include <benchmark/benchmark.h>
 
 #include "ht.h"
+#include "ht_concurrent.h"
+#include "ht_mmap.h"
 
 typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
 
@@ -107,7 +118,7 @@ struct hash<std::array<T,N>> {
         using argument_type = std::array<T,N>;
         using result_type = std::size_t;
 
-        result_type operator()(argument_type const& s)
+        result_type operator()(argument_type const& s) const
         {
                 size_t hash = 0;
 
@@ -120,6 +131,111 @@ struct hash<std::array<T,N>> {
 };
 }
 
+template <size_t GroupWidth>
+using wide_set = hash_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>,
+                          std::allocator<uint32_t>, GroupWidth>;
+
+// big elements go to node storage on their own. This keeps them in the slots, for comparison
+template <typename T>
+using flat_set = hash_set<T, ht_hash<T>, std::equal_to<T>, std::allocator<T>, 16,
+                          slot_storage::flat>;
+
+// Example bump arena: hands out memory by bumping a pointer, frees nothing until reset(). Good for
+// tables that live and die with one request.
+class bump_arena {
+public:
+        explicit bump_arena(size_t size)
+                : buf_{new uint8_t[size]}, size_{size}, used_{0}
+        {}
+
+        void * allocate(size_t n, size_t align)
+        {
+                size_t start = (used_ + align - 1) & ~(align - 1);
+                if (start + n > size_) {
+                        throw std::bad_alloc{};
+                }
+                used_ = start + n;
+                return buf_.get() + start;
+        }
+
+        void reset()
+        {
+                used_ = 0;
+        }
+
+private:
+        std::unique_ptr<uint8_t[]> buf_;
+        size_t size_;
+        size_t used_;
+};
+
+template <typename T>
+struct arena_allocator {
+        using value_type = T;
+
+        bump_arena * arena;
+
+        explicit arena_allocator(bump_arena * a) : arena{a}
+        {}
+
+        template <typename U>
+        arena_allocator(const arena_allocator<U>& rhs) : arena{rhs.arena}
+        {}
+
+        T * allocate(size_t n)
+        {
+                return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T *, size_t)
+        {}
+
+        template <typename U>
+        bool operator==(const arena_allocator<U>& rhs) const
+        {
+                return arena == rhs.arena;
+        }
+
+        template <typename U>
+        bool operator!=(const arena_allocator<U>& rhs) const
+        {
+                return arena != rhs.arena;
+        }
+};
+
+using arena_set = hash_set<uint32_t, std::hash<uint32_t>, std::equal_to<uint32_t>,
+                           arena_allocator<uint32_t>>;
+
+// create a table, fill it with range(0) elements, and tear it down, like a per-request set would
+static void BM_create_destroy_malloc(benchmark::State& state)
+{
+        for (auto _ : state) {
+                hash_set<uint32_t> s;
+                for (int i = 0; i < state.range(0); ++i) {
+                        s.insert(pcg32_random());
+                }
+                benchmark::DoNotOptimize(s.size());
+        }
+}
+BENCHMARK(BM_create_destroy_malloc)->Range(8, 8<<10);
+
+static void BM_create_destroy_arena(benchmark::State& state)
+{
+        // every growth step stays live in the arena until reset, so leave room for all of them
+        bump_arena arena{size_t(state.range(0)) * 64 + 4096};
+        for (auto _ : state) {
+                {
+                        arena_set s{arena_allocator<uint32_t>{&arena}};
+                        for (int i = 0; i < state.range(0); ++i) {
+                                s.insert(pcg32_random());
+                        }
+                        benchmark::DoNotOptimize(s.size());
+                }
+                arena.reset();
+        }
+}
+BENCHMARK(BM_create_destroy_arena)->Range(8, 8<<10);
+
 template <typename S> 
 static void BM_insert(benchmark::State& state)
 {
@@ -134,14 +250,299 @@ static void BM_insert(benchmark::State& state)
 }
 BENCHMARK_TEMPLATE(BM_insert, hash_set<uint32_t>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<uint32_t>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, wide_set<32>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, wide_set<64>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, small_hash_set<uint32_t>)->Range(8, 8<<20);
+// sets that never get anything put in them
+BENCHMARK_TEMPLATE(BM_insert, hash_set<uint32_t>)->Arg(0);
+BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<uint32_t>)->Arg(0);
 BENCHMARK_TEMPLATE(BM_insert, hash_set<std::array<uint32_t, 16>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<std::array<uint32_t, 16>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, hash_set<std::array<uint32_t, 64>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<std::array<uint32_t, 64>>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, flat_set<std::array<uint32_t, 64>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, hash_set<std::array<uint32_t, 256>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<std::array<uint32_t, 256>>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, flat_set<std::array<uint32_t, 256>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, hash_set<std::array<uint32_t, 1024>>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_insert, std::unordered_set<std::array<uint32_t, 1024>>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert, flat_set<std::array<uint32_t, 1024>>)->Range(8, 8<<20);
+
+// Big keys with the slow hash_combine hash above, so hashing and comparing keys is most of the
+// work. With StoreHash the table keeps each hash and never calls the hasher again after insert.
+template <typename T, bool StoreHash>
+using slow_hash_set = hash_set<T, std::hash<T>, std::equal_to<T>, std::allocator<T>, 16,
+                               slot_storage::automatic, false, StoreHash>;
+
+BENCHMARK_TEMPLATE(BM_insert, slow_hash_set<std::array<uint32_t, 256>, false>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_insert, slow_hash_set<std::array<uint32_t, 256>, true>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_insert, slow_hash_set<std::array<uint32_t, 1024>, false>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_insert, slow_hash_set<std::array<uint32_t, 1024>, true>)->Range(8, 8<<12);
+
+// what everything allocated through tally_allocator holds right now
+static size_t g_tally_bytes;
+
+template <typename T>
+struct tally_allocator {
+        using value_type = T;
+
+        tally_allocator() = default;
+
+        template <typename U>
+        tally_allocator(const tally_allocator<U>&)
+        {}
+
+        T * allocate(size_t n)
+        {
+                g_tally_bytes += n * sizeof(T);
+                return std::allocator<T>{}.allocate(n);
+        }
+
+        void deallocate(T * p, size_t n)
+        {
+                g_tally_bytes -= n * sizeof(T);
+                std::allocator<T>{}.deallocate(p, n);
+        }
+
+        template <typename U>
+        bool operator==(const tally_allocator<U>&) const
+        {
+                return true;
+        }
+
+        template <typename U>
+        bool operator!=(const tally_allocator<U>&) const
+        {
+                return false;
+        }
+};
+
+template <typename T, typename Sizing>
+using tally_set = hash_set<T, ht_hash<T>, std::equal_to<T>, tally_allocator<T>, 16,
+                           slot_storage::automatic, false, false, linear_probing, Sizing>;
+
+template <typename T>
+using tally_unordered_set = std::unordered_set<T, std::hash<T>, std::equal_to<T>,
+                                               tally_allocator<T>>;
+
+// Insert throughput, with how many bytes the finished set holds per element next to it. The
+// interesting sizes are the ones just past a power of two divided by 0.7, where doubling leaves
+// the most empty slots.
+template <typename S>
+static void BM_footprint(benchmark::State& state)
+{
+        using T = typename S::value_type;
+
+        size_t bytes = 0;
+        for (auto _ : state) {
+                S s;
+                for (int i = 0; i < state.range(0); ++i) {
+                        s.insert(get_random<T>());
+                }
+                bytes = g_tally_bytes;
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+        state.counters["bytes_per_elem"] = double(bytes) / state.range(0);
+}
+BENCHMARK_TEMPLATE(BM_footprint, tally_set<uint32_t, pow2_sizing>)
+        ->Arg(3<<20)->Arg(6<<20)->Arg(9<<20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_footprint, tally_set<uint32_t, compact_sizing>)
+        ->Arg(3<<20)->Arg(6<<20)->Arg(9<<20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_footprint, tally_unordered_set<uint32_t>)
+        ->Arg(3<<20)->Arg(6<<20)->Arg(9<<20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_footprint, tally_set<std::array<uint32_t, 16>, pow2_sizing>)
+        ->Arg(3<<20)->Arg(9<<20)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_footprint, tally_set<std::array<uint32_t, 16>, compact_sizing>)
+        ->Arg(3<<20)->Arg(9<<20)->Unit(benchmark::kMillisecond);
+
+// Per-insert latency while filling a set from empty. The mean is the same story BM_insert tells;
+// the interesting counters are the tail, which for hash_set is whichever insert triggered the last
+// resize.
+template <typename S>
+static void BM_insert_latency(benchmark::State& state)
+{
+        const size_t n = state.range(0);
+        std::vector<uint32_t> keys(n);
+        for (auto& k : keys) {
+                k = pcg32_random();
+        }
+        std::vector<uint64_t> lat(n);
+        uint64_t worst = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+
+        for (auto _ : state) {
+                S s;
+                for (size_t i = 0; i < n; ++i) {
+                        auto start = std::chrono::steady_clock::now();
+                        s.insert(keys[i]);
+                        auto end = std::chrono::steady_clock::now();
+                        lat[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                                .count();
+                }
+
+                state.PauseTiming();
+                std::sort(lat.begin(), lat.end());
+                worst = std::max(worst, lat.back());
+                p99 = std::max(p99, lat[n * 99 / 100]);
+                p999 = std::max(p999, lat[n * 999 / 1000]);
+                state.ResumeTiming();
+        }
+        state.counters["max_ns"] = worst;
+        state.counters["p99_ns"] = p99;
+        state.counters["p999_ns"] = p999;
+}
+BENCHMARK_TEMPLATE(BM_insert_latency, hash_set<uint32_t>)->Range(1<<16, 8<<20);
+BENCHMARK_TEMPLATE(BM_insert_latency, incremental_hash_set<uint32_t>)->Range(1<<16, 8<<20);
+
+// Loading a known number of keys, with and without reserving room for them first.
+template <bool Reserve>
+static void BM_bulk_load(benchmark::State& state)
+{
+        for (auto _ : state) {
+                hash_set<uint32_t> s;
+                if (Reserve) {
+                        s.reserve(state.range(0));
+                }
+                for (int i = 0; i < state.range(0); ++i) {
+                        s.insert(pcg32_random());
+                }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_bulk_load, false)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_bulk_load, true)->Range(8, 8<<20);
+
+// Cloning a populated set. Trivially copyable elements copy the whole buffer in one memcpy.
+template <typename S>
+static void BM_copy(benchmark::State& state)
+{
+        S s;
+        for (int i = 0; i < state.range(0); ++i) {
+                s.insert(pcg32_random());
+        }
+        for (auto _ : state) {
+                S copy{s};
+                benchmark::DoNotOptimize(copy);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_copy, hash_set<uint32_t>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_copy, std::unordered_set<uint32_t>)->Range(8, 8<<20);
+
+// Walk every element of an 8M slot table that's been filled to just under the resize threshold
+// and then had everything but arg percent of it erased, so most of the work at low percentages is
+// getting past empty slots.
+template <typename S>
+static void BM_iterate(benchmark::State& state)
+{
+        S s{size_t(8) << 20};
+        while (s.load() < 0.69) {
+                s.insert(pcg32_random());
+        }
+        std::vector<uint32_t> all{s.begin(), s.end()};
+        for (uint32_t v : all) {
+                if (v % 100 >= uint32_t(state.range(0))) {
+                        s.erase(v);
+                }
+        }
+
+        for (auto _ : state) {
+                uint64_t sum = 0;
+                for (uint32_t v : s) {
+                        sum += v;
+                }
+                benchmark::DoNotOptimize(sum);
+        }
+        state.SetItemsProcessed(state.iterations() * s.size());
+}
+BENCHMARK_TEMPLATE(BM_iterate, hash_set<uint32_t>)->Arg(1)->Arg(10)->Arg(50)->Arg(100);
+BENCHMARK_TEMPLATE(BM_iterate, wide_set<64>)->Arg(1)->Arg(10)->Arg(50)->Arg(100);
+
+enum class sweep { by_key, by_iterator, erase_if };
+
+// Expire half of an 8M element set: collect the keys and erase each one (all we had before),
+// erase through the iterator as we walk, or erase_if.
+template <sweep How>
+static void BM_sweep(benchmark::State& state)
+{
+        hash_set<uint32_t> full;
+        while (full.size() < (size_t(8) << 20)) {
+                full.insert(pcg32_random());
+        }
+        const auto expired = [](uint32_t v) { return v % 2 == 0; };
+
+        for (auto _ : state) {
+                state.PauseTiming();
+                hash_set<uint32_t> s{full};
+                state.ResumeTiming();
+
+                if (How == sweep::by_key) {
+                        std::vector<uint32_t> keys;
+                        for (uint32_t v : s) {
+                                if (expired(v)) {
+                                        keys.push_back(v);
+                                }
+                        }
+                        for (uint32_t v : keys) {
+                                s.erase(v);
+                        }
+                } else if (How == sweep::by_iterator) {
+                        for (auto it = s.begin(); it != s.end();) {
+                                it = expired(*it) ? s.erase(it) : std::next(it);
+                        }
+                } else {
+                        s.erase_if(expired);
+                }
+                benchmark::DoNotOptimize(s.size());
+        }
+}
+BENCHMARK_TEMPLATE(BM_sweep, sweep::by_key)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_sweep, sweep::by_iterator)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_sweep, sweep::erase_if)->Unit(benchmark::kMillisecond);
+
+// Getting from nothing to a set that can answer lookups, then doing 1000 of them: rebuild it by
+// inserting everything, or map a snapshot saved earlier. The mapped side only pages in what the
+// lookups touch (the file is in the page cache after the first run, so this is the warm case).
+template <bool Mapped>
+static void BM_startup(benchmark::State& state)
+{
+        std::vector<uint64_t> keys;
+        for (int i = 0; i < state.range(0); ++i) {
+                keys.push_back(uint64_t{pcg32_random()} << 32 | pcg32_random());
+        }
+
+        char path[] = "/tmp/ht_bench_snapshotXXXXXX";
+        close(mkstemp(path));
+        {
+                hash_set<uint64_t> s;
+                s.reserve(keys.size());
+                for (uint64_t k : keys) {
+                        s.insert(k);
+                }
+                s.save(path);
+        }
+
+        for (auto _ : state) {
+                if (Mapped) {
+                        mapped_hash_set<hash_set<uint64_t>> m{path};
+                        for (size_t i = 0; i < 1000; ++i) {
+                                benchmark::DoNotOptimize(m.find(keys[i % keys.size()]));
+                        }
+                } else {
+                        hash_set<uint64_t> s;
+                        for (uint64_t k : keys) {
+                                s.insert(k);
+                        }
+                        for (size_t i = 0; i < 1000; ++i) {
+                                benchmark::DoNotOptimize(s.find(keys[i % keys.size()]));
+                        }
+                }
+        }
+        unlink(path);
+}
+BENCHMARK_TEMPLATE(BM_startup, false)->Range(1<<10, 8<<20);
+BENCHMARK_TEMPLATE(BM_startup, true)->Range(1<<10, 8<<20);
 
 
 
@@ -161,11 +562,636 @@ static void BM_find_exists(benchmark::State& state)
                 std::vector<T> to_find{all.begin(), all.begin() + state.range(0)};
                 state.ResumeTiming();
                 for (int i = 0; i < state.range(0); ++i) {
-                        s.find(to_find[i]);
+                        benchmark::DoNotOptimize(s.find(to_find[i]));
                 }
         }
 }
 BENCHMARK_TEMPLATE(BM_find_exists, hash_set<uint32_t>)->Range(8, 8<<20);
 BENCHMARK_TEMPLATE(BM_find_exists, std::unordered_set<uint32_t>)->Range(8, 8<<20);
 
+// Lookups in a set that's built once and then only read: the regular hash_set, or frozen_hash_set
+// built from the same keys. Hits looks up keys that are there, otherwise keys that aren't.
+template <typename S>
+static S build_static_set(const std::vector<uint32_t>& keys)
+{
+        S s;
+        for (uint32_t k : keys) {
+                s.insert(k);
+        }
+        return s;
+}
+
+template <>
+frozen_hash_set<uint32_t> build_static_set(const std::vector<uint32_t>& keys)
+{
+        return frozen_hash_set<uint32_t>{keys.begin(), keys.end()};
+}
+
+template <typename S, bool Hits>
+static void BM_static_find(benchmark::State& state)
+{
+        std::vector<uint32_t> keys;
+        for (int i = 0; i < state.range(0); ++i) {
+                keys.push_back(pcg32_random());
+        }
+        const S s = build_static_set<S>(keys);
+
+        std::vector<uint32_t> to_find;
+        for (int i = 0; i < state.range(0); ++i) {
+                to_find.push_back(Hits ? keys[i] : pcg32_random());
+        }
+        std::random_shuffle(to_find.begin(), to_find.end());
+
+        for (auto _ : state) {
+                for (uint32_t k : to_find) {
+                        benchmark::DoNotOptimize(s.find(k));
+                }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_static_find, hash_set<uint32_t>, true)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_static_find, frozen_hash_set<uint32_t>, true)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_static_find, hash_set<uint32_t>, false)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_static_find, frozen_hash_set<uint32_t>, false)->Range(8, 8<<20);
+
+// Half hits, half misses, on keys that are expensive to hash and compare
+template <typename S>
+static void BM_find_large(benchmark::State& state)
+{
+        using T = typename std::decay<decltype(*std::declval<S>().begin())>::type;
+
+        S s;
+        std::vector<T> to_find;
+        for (int i = 0; i < state.range(0); ++i) {
+                T v = get_random<T>();
+                s.insert(v);
+                to_find.push_back(i % 2 == 0 ? v : get_random<T>());
+        }
+        std::random_shuffle(to_find.begin(), to_find.end());
+
+        for (auto _ : state) {
+                for (const T& v : to_find) {
+                        benchmark::DoNotOptimize(s.find(v));
+                }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_find_large, slow_hash_set<std::array<uint32_t, 256>, false>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_find_large, slow_hash_set<std::array<uint32_t, 256>, true>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_find_large, slow_hash_set<std::array<uint32_t, 1024>, false>)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_find_large, slow_hash_set<std::array<uint32_t, 1024>, true>)->Range(8, 8<<12);
+
+// Each key checked against three tables, either letting each table hash it or hashing it once and
+// handing the hash to all three
+template <bool Precomputed>
+static void BM_multi_probe(benchmark::State& state)
+{
+        using T = std::array<uint32_t, 256>;
+        using S = slow_hash_set<T, false>;
+
+        S dedup, tenant, global;
+        std::vector<T> keys;
+        for (int i = 0; i < state.range(0); ++i) {
+                keys.push_back(get_random<T>());
+                if (i % 2 == 0) {
+                        dedup.insert(keys.back());
+                }
+                if (i % 3 == 0) {
+                        tenant.insert(keys.back());
+                }
+                global.insert(keys.back());
+        }
+
+        const auto hasher = dedup.hash_function();
+        for (auto _ : state) {
+                for (const T& k : keys) {
+                        if (Precomputed) {
+                                const size_t h = hasher(k);
+                                benchmark::DoNotOptimize(dedup.find(k, h));
+                                benchmark::DoNotOptimize(tenant.find(k, h));
+                                benchmark::DoNotOptimize(global.find(k, h));
+                        } else {
+                                benchmark::DoNotOptimize(dedup.find(k));
+                                benchmark::DoNotOptimize(tenant.find(k));
+                                benchmark::DoNotOptimize(global.find(k));
+                        }
+                }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_multi_probe, false)->Range(8, 8<<12);
+BENCHMARK_TEMPLATE(BM_multi_probe, true)->Range(8, 8<<12);
+
+// Lookups with string_views into a buffer, the way a parser would hand them over. The plain set has
+// to build (and, past SSO, allocate) a std::string per lookup; the transparent one hashes and
+// compares the view directly.
+using plain_string_set = hash_set<std::string>;
+using transparent_string_set = hash_set<std::string, ht_hash<std::string>, std::equal_to<>>;
+
+template <typename S>
+static void BM_find_string_view(benchmark::State& state)
+{
+        S s;
+        std::string buf;
+        std::vector<std::pair<size_t, size_t>> spans;
+        for (int i = 0; i < state.range(0); ++i) {
+                std::string key = "some/longish/request/path/" + std::to_string(pcg32_random());
+                if (i % 2 == 0) {
+                        s.insert(key);
+                }
+                spans.emplace_back(buf.size(), key.size());
+                buf += key;
+        }
+
+        for (auto _ : state) {
+                for (auto span : spans) {
+                        std::string_view key{buf.data() + span.first, span.second};
+                        if constexpr (std::is_same<S, plain_string_set>::value) {
+                                benchmark::DoNotOptimize(s.find(std::string{key}));
+                        } else {
+                                benchmark::DoNotOptimize(s.find(key));
+                        }
+                }
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_find_string_view, plain_string_set)->Range(8, 8<<16);
+BENCHMARK_TEMPLATE(BM_find_string_view, transparent_string_set)->Range(8, 8<<16);
+
+template <typename S>
+static void BM_find_many(benchmark::State& state)
+{
+        using T = typename S::value_type;
+
+        for (auto _ : state) {
+                state.PauseTiming();
+                S s;
+                for (int i = 0; i < state.range(0) * 2; ++i) {
+                        s.insert(pcg32_random());
+                }
+                std::vector<T> all{s.begin(), s.end()};
+                std::random_shuffle(all.begin(), all.end());
+                std::vector<T> to_find{all.begin(), all.begin() + state.range(0)};
+                std::vector<typename S::iterator> out(to_find.size());
+                state.ResumeTiming();
+                s.find_many(to_find.data(), to_find.size(), out.data());
+                benchmark::DoNotOptimize(out.data());
+        }
+}
+BENCHMARK_TEMPLATE(BM_find_many, hash_set<uint32_t>)->Range(8, 8<<20);
+
+// lookups at high load (just under the resize threshold) with each scan kernel and group width.
+// Second arg is the group_kernel to force; kernels this cpu can't run are skipped.
+template <typename S>
+static void BM_find_kernel(benchmark::State& state)
+{
+        const group_kernel orig = active_group_kernel();
+        const group_kernel k = static_cast<group_kernel>(state.range(1));
+        if (!set_group_kernel(k)) {
+                state.SkipWithError("kernel not supported on this cpu");
+                return;
+        }
+        state.SetLabel(group_kernel_name(k));
+
+        S s{size_t(state.range(0))};
+        while (s.load() < 0.69) {
+                s.insert(pcg32_random());
+        }
+        std::vector<uint32_t> to_find{s.begin(), s.end()};
+        std::random_shuffle(to_find.begin(), to_find.end());
+
+        size_t i = 0;
+        for (auto _ : state) {
+                // alternate hits and (almost certainly) misses
+                benchmark::DoNotOptimize(s.find(to_find[i++ % to_find.size()]));
+                benchmark::DoNotOptimize(s.find(pcg32_random()));
+        }
+
+        set_group_kernel(orig);
+}
+
+static void kernel_args(benchmark::internal::Benchmark * b)
+{
+        for (int size : {1 << 12, 1 << 16, 1 << 22}) {
+                for (int k = 0; k <= static_cast<int>(group_kernel::avx512bw); ++k) {
+                        b->Args({size, k});
+                }
+        }
+}
+BENCHMARK_TEMPLATE(BM_find_kernel, wide_set<16>)->Apply(kernel_args);
+BENCHMARK_TEMPLATE(BM_find_kernel, wide_set<32>)->Apply(kernel_args);
+BENCHMARK_TEMPLATE(BM_find_kernel, wide_set<64>)->Apply(kernel_args);
+
+// steady insert/erase churn at a fixed size: each iteration erases a random live key and
+// inserts a fresh one
+template <typename S>
+static void BM_churn(benchmark::State& state)
+{
+        S s;
+        std::vector<uint32_t> live;
+        for (int i = 0; i < state.range(0); ++i) {
+                uint32_t val = pcg32_random();
+                if (s.insert(val).second) {
+                        live.push_back(val);
+                }
+        }
+
+        for (auto _ : state) {
+                uint32_t& victim = live[pcg32_random() % live.size()];
+                s.erase(victim);
+                do {
+                        victim = pcg32_random();
+                } while (!s.insert(victim).second);
+        }
+}
+BENCHMARK_TEMPLATE(BM_churn, hash_set<uint32_t>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_churn, std::unordered_set<uint32_t>)->Range(8, 8<<20);
+
+enum key_dist { sequential, strided, random_keys };
+
+static uint32_t make_key(key_dist dist, uint32_t i)
+{
+        switch (dist) {
+        case sequential: return i;
+        case strided: return i * 4096;
+        case random_keys: break;
+        }
+        return pcg32_random();
+}
+
+static const char * key_dist_name(key_dist dist)
+{
+        switch (dist) {
+        case sequential: return "sequential";
+        case strided: return "strided";
+        case random_keys: break;
+        }
+        return "random";
+}
+
+// hash quality: how long successful probes are for a few key distributions, and what a lookup
+// costs with them
+template <typename S>
+static void BM_probe_length(benchmark::State& state)
+{
+        const key_dist dist = static_cast<key_dist>(state.range(1));
+        state.SetLabel(key_dist_name(dist));
+
+        S s;
+        std::vector<uint32_t> keys;
+        for (uint32_t i = 0; i < state.range(0); ++i) {
+                keys.push_back(make_key(dist, i));
+                s.insert(keys.back());
+        }
+
+        auto stats = s.__probe_stats();
+        state.counters["avg_probe"] = stats.mean;
+        state.counters["max_probe"] = stats.max;
+
+        size_t i = 0;
+        for (auto _ : state) {
+                benchmark::DoNotOptimize(s.find(keys[i++ % keys.size()]));
+        }
+}
+
+static void probe_args(benchmark::internal::Benchmark * b)
+{
+        for (int size : {1 << 10, 1 << 16, 1 << 20}) {
+                for (int dist : {sequential, strided, random_keys}) {
+                        b->Args({size, dist});
+                }
+        }
+}
+BENCHMARK_TEMPLATE(BM_probe_length, hash_set<uint32_t>)->Apply(probe_args);
+
+// a weak hash: every 8 consecutive keys hash the same, so sequential keys start their probes in
+// runs of 8 on one group and spill into the groups around it
+struct coarse_hash {
+        size_t operator()(uint32_t v) const
+        {
+                return v >> 3;
+        }
+};
+
+template <typename Probe, typename Hash = ht_hash<uint32_t>>
+using probing_set = hash_set<uint32_t, Hash, std::equal_to<uint32_t>, std::allocator<uint32_t>,
+                             16, slot_storage::automatic, false, false, Probe>;
+
+// Probe lengths and the cost of a hit plus a miss in a 1M slot table at arg 0 percent load, for
+// each key distribution. With arg 2 set, half the keys get erased and replaced with new ones
+// first, which leaves tombstones for probes to walk past.
+template <typename S>
+static void BM_probe_load(benchmark::State& state)
+{
+        const double load = state.range(0) / 100.0;
+        const key_dist dist = static_cast<key_dist>(state.range(1));
+        state.SetLabel(key_dist_name(dist));
+
+        S s{size_t(1) << 20};
+        std::vector<uint32_t> keys;
+        uint32_t next = 0;
+        const auto fill = [&] {
+                while (s.load() < load) {
+                        const uint32_t k = make_key(dist, next++);
+                        if (s.insert(k).second) {
+                                keys.push_back(k);
+                        }
+                }
+        };
+        fill();
+        if (state.range(2)) {
+                std::vector<uint32_t> kept;
+                for (size_t i = 0; i < keys.size(); ++i) {
+                        if (i % 2 == 0) {
+                                s.erase(keys[i]);
+                        } else {
+                                kept.push_back(keys[i]);
+                        }
+                }
+                keys.swap(kept);
+                fill();
+        }
+        std::random_shuffle(keys.begin(), keys.end());
+        std::vector<uint32_t> misses;
+        while (misses.size() < keys.size()) {
+                const uint32_t k = make_key(dist, next++);
+                if (!s.contains(k)) {
+                        misses.push_back(k);
+                }
+        }
+
+        auto stats = s.__probe_stats();
+        state.counters["avg_probe"] = stats.mean;
+        state.counters["max_probe"] = stats.max;
+
+        size_t i = 0;
+        for (auto _ : state) {
+                benchmark::DoNotOptimize(s.find(keys[i]));
+                benchmark::DoNotOptimize(s.find(misses[i]));
+                i = i + 1 == keys.size() ? 0 : i + 1;
+        }
+}
+
+static void probe_load_args(benchmark::internal::Benchmark * b)
+{
+        for (int churn : {0, 1}) {
+                for (int load : {30, 50, 69}) {
+                        for (int dist : {sequential, strided, random_keys}) {
+                                b->Args({load, dist, churn});
+                        }
+                }
+        }
+}
+BENCHMARK_TEMPLATE(BM_probe_load, probing_set<linear_probing>)->Apply(probe_load_args);
+BENCHMARK_TEMPLATE(BM_probe_load, probing_set<triangular_probing>)->Apply(probe_load_args);
+BENCHMARK_TEMPLATE(BM_probe_load, probing_set<linear_probing, coarse_hash>)
+        ->Apply(probe_load_args);
+BENCHMARK_TEMPLATE(BM_probe_load, probing_set<triangular_probing, coarse_hash>)
+        ->Apply(probe_load_args);
+
+// one big global lock around a plain hash_set, as a baseline for the sharded set
+class mutex_hash_set {
+public:
+        bool insert(uint32_t v)
+        {
+                std::lock_guard<std::mutex> guard{lock_};
+                return set_.insert(v).second;
+        }
+
+        void erase(uint32_t v)
+        {
+                std::lock_guard<std::mutex> guard{lock_};
+                set_.erase(v);
+        }
+
+        bool contains(uint32_t v) const
+        {
+                std::lock_guard<std::mutex> guard{lock_};
+                return set_.find(v) != set_.end();
+        }
+
+private:
+        mutable std::mutex lock_;
+        hash_set<uint32_t> set_;
+};
+
+// Every thread inserts its own stream of keys (and looks up a recent one) into one shared set.
+// Items per second is total throughput across all threads.
+template <typename S>
+static void BM_concurrent_insert(benchmark::State& state)
+{
+        static S * shared;
+        if (state.thread_index() == 0) {
+                shared = new S;
+        }
+
+        // pcg32_random's state isn't thread safe, so each thread gets its own cheap generator
+        uint32_t x = 0x9e3779b9u * (state.thread_index() + 1);
+        for (auto _ : state) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                shared->insert(x);
+                benchmark::DoNotOptimize(shared->contains(x >> 1));
+        }
+        state.SetItemsProcessed(state.iterations());
+
+        if (state.thread_index() == 0) {
+                delete shared;
+        }
+}
+BENCHMARK_TEMPLATE(BM_concurrent_insert, concurrent_hash_set<uint32_t>)
+        ->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_concurrent_insert, mutex_hash_set)->ThreadRange(1, 32)->UseRealTime();
+
+// insert-only "seen before" filter under contention: keys come from a bounded space so every
+// thread hits a mix of new and already-present keys, and a fixed capacity table never fills
+static const uint32_t seen_key_space = 1 << 22;
+
+struct lockfree_seen_set : lockfree_hash_set<uint32_t> {
+        lockfree_seen_set() : lockfree_hash_set<uint32_t>{seen_key_space}
+        {}
+};
+
+template <typename S>
+static void BM_seen_filter(benchmark::State& state)
+{
+        static S * shared;
+        if (state.thread_index() == 0) {
+                shared = new S;
+        }
+
+        uint32_t x = 0x9e3779b9u * (state.thread_index() + 1);
+        for (auto _ : state) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                const uint32_t key = x & (seen_key_space - 1);
+                if (!shared->contains(key)) {
+                        shared->insert(key);
+                }
+        }
+        state.SetItemsProcessed(state.iterations());
+
+        if (state.thread_index() == 0) {
+                delete shared;
+        }
+}
+BENCHMARK_TEMPLATE(BM_seen_filter, lockfree_seen_set)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_seen_filter, mutex_hash_set)->ThreadRange(1, 32)->UseRealTime();
+
+// read-mostly: every thread looks up keys that are always there, and thread 0 also inserts or
+// erases a key outside that set once every range(0) operations. Items per second only counts
+// the reads.
+static const uint32_t read_mostly_keys = 1 << 16;
+
+struct rcu_read_set : rcu_hash_set<uint32_t> {
+        void insert(uint32_t v)
+        {
+                update([v](hash_set<uint32_t>& s) { s.insert(v); });
+        }
+
+        void erase(uint32_t v)
+        {
+                update([v](hash_set<uint32_t>& s) { s.erase(v); });
+        }
+};
+
+// every rcu insert copies the whole table, so preload it in one update
+template <typename S>
+static void read_mostly_fill(S& s)
+{
+        for (uint32_t i = 0; i < read_mostly_keys; ++i) {
+                s.insert(i);
+        }
+}
+
+static void read_mostly_fill(rcu_read_set& s)
+{
+        s.update([](hash_set<uint32_t>& set) {
+                for (uint32_t i = 0; i < read_mostly_keys; ++i) {
+                        set.insert(i);
+                }
+        });
+}
+
+template <typename S>
+struct read_handle {
+        S& set;
+
+        explicit read_handle(S& s) : set{s}
+        {}
+
+        bool contains(uint32_t v)
+        {
+                return set.contains(v);
+        }
+};
+
+template <>
+struct read_handle<rcu_read_set> {
+        rcu_hash_set<uint32_t>::reader reader;
+
+        explicit read_handle(rcu_read_set& s) : reader{s.make_reader()}
+        {}
+
+        bool contains(uint32_t v)
+        {
+                return reader.contains(v);
+        }
+};
+
+template <typename S>
+static void BM_read_mostly(benchmark::State& state)
+{
+        // readers hold a handle (an rcu reader slot) across the whole run, so the set can't just
+        // be freed by thread 0 after the loop; the last thread out frees it instead
+        static std::atomic<S *> shared;
+        static std::atomic<int> users;
+        if (state.thread_index() == 0) {
+                S * s = new S;
+                read_mostly_fill(*s);
+                users = state.threads();
+                shared = s;
+        }
+        S * s;
+        while (!(s = shared.load())) {
+                std::this_thread::yield();
+        }
+
+        uint32_t x = 0x9e3779b9u * (state.thread_index() + 1);
+        const int64_t write_every = state.thread_index() == 0 ? state.range(0) : 0;
+        int64_t until_write = write_every;
+        int64_t reads = 0;
+        {
+                read_handle<S> h{*s};
+                for (auto _ : state) {
+                        x ^= x << 13;
+                        x ^= x >> 17;
+                        x ^= x << 5;
+                        if (write_every && --until_write == 0) {
+                                until_write = write_every;
+                                const uint32_t key = read_mostly_keys + (x & 1023);
+                                if (x & 1) {
+                                        s->insert(key);
+                                } else {
+                                        s->erase(key);
+                                }
+                        } else {
+                                benchmark::DoNotOptimize(h.contains(x & (read_mostly_keys - 1)));
+                                ++reads;
+                        }
+                }
+        }
+        state.SetItemsProcessed(reads);
+
+        if (--users == 0) {
+                shared = nullptr;
+                delete s;
+        }
+}
+BENCHMARK_TEMPLATE(BM_read_mostly, rcu_read_set)
+        ->Arg(1 << 10)->Arg(1 << 16)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_read_mostly, concurrent_hash_set<uint32_t>)
+        ->Arg(1 << 10)->Arg(1 << 16)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_read_mostly, mutex_hash_set)
+        ->Arg(1 << 10)->Arg(1 << 16)->ThreadRange(1, 32)->UseRealTime();
+
+template <typename M>
+static void BM_map_insert(benchmark::State& state)
+{
+        for (auto _ : state) {
+                M m;
+                for (int i = 0; i < state.range(0); ++i) {
+                        m[pcg32_random()] = i;
+                }
+        }
+}
+BENCHMARK_TEMPLATE(BM_map_insert, hash_map<uint32_t, uint32_t>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_map_insert, std::unordered_map<uint32_t, uint32_t>)->Range(8, 8<<20);
+
+template <typename M>
+static void BM_map_find_exists(benchmark::State& state)
+{
+        for (auto _ : state) {
+                state.PauseTiming();
+                M m;
+                for (int i = 0; i < state.range(0) * 2; ++i) {
+                        m[pcg32_random()] = i;
+                }
+                std::vector<uint32_t> all;
+                for (const auto& kv : m) {
+                        all.push_back(kv.first);
+                }
+                std::random_shuffle(all.begin(), all.end());
+                all.resize(state.range(0));
+                state.ResumeTiming();
+                for (int i = 0; i < state.range(0); ++i) {
+                        benchmark::DoNotOptimize(m.at(all[i]));
+                }
+        }
+}
+BENCHMARK_TEMPLATE(BM_map_find_exists, hash_map<uint32_t, uint32_t>)->Range(8, 8<<20);
+BENCHMARK_TEMPLATE(BM_map_find_exists, std::unordered_map<uint32_t, uint32_t>)->Range(8, 8<<20);
+
 BENCHMARK_MAIN();
@@ -1,6 +1,16 @@
 #include "ht.h"
+#include "ht_concurrent.h"
+#include "ht_mmap.h"
 #include <iostream>
 #include <unordered_set>
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <numeric>
 
 using namespace std;
 
@@ -96,10 +106,67 @@ void test_basic()
         assert(s.size() == 0);
 }
 
+// iterate a table that's mostly empty, forwards and back, and make sure the walk stops at the end
+// byte rather than running into the slots
+template <typename S>
+static void check_sparse_iter()
+{
+        S s;
+        assert(s.begin() == s.end());
+        for (int i = 0; i < 10000; ++i) {
+                s.insert(i);
+        }
+        for (int i = 0; i < 10000; ++i) {
+                if (i % 97 != 0) {
+                        s.erase(i);
+                }
+        }
+
+        vector<int> seen(s.begin(), s.end());
+        assert(seen.size() == s.size() && seen.size() == 104);
+        sort(seen.begin(), seen.end());
+        for (size_t i = 0; i < seen.size(); ++i) {
+                assert(seen[i] == int(i * 97));
+        }
+
+        vector<int> back;
+        auto it = s.end();
+        while (it != s.begin()) {
+                --it;
+                back.push_back(*it);
+        }
+        vector<int> fwd(s.begin(), s.end());
+        reverse(back.begin(), back.end());
+        assert(back == fwd);
+
+        // one element, and nothing at all
+        for (int v : fwd) {
+                s.erase(v);
+        }
+        s.insert(9999);
+        assert(++s.begin() == s.end() && *s.begin() == 9999);
+        s.erase(9999);
+        assert(s.begin() == s.end());
+}
+
 void test_iter()
 {
         cout << __func__ << endl;
 
+        static_assert(sizeof(hash_set<int>::iterator) == 2 * sizeof(void *), "");
+        static_assert(sizeof(hash_set<int>::const_iterator) == 2 * sizeof(void *), "");
+        check_sparse_iter<hash_set<int>>();
+        check_sparse_iter<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 32>>();
+        check_sparse_iter<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 64>>();
+        check_sparse_iter<node_hash_set<int>>();
+        check_sparse_iter<small_hash_set<int>>();
+
+        small_hash_set<string> inl;
+        for (const char * v : {"a", "b", "c"}) {
+                inl.insert(v);
+        }
+        assert(vector<string>(inl.begin(), inl.end()).size() == 3);
+
         unordered_set<int> ctrl;
         hash_set<int> s;
 
@@ -127,6 +194,1924 @@ void test_iter()
         }
 }
 
+void test_erase_no_tombstone()
+{
+        cout << __func__ << endl;
+
+        hash_set<int> s;
+
+        // a few elements in a 16 slot table always leave an empty slot in the one group, so erase
+        // never needs a tombstone and the load factor goes all the way back down
+        for (int i = 0; i < 5; ++i) {
+                s.insert(i);
+        }
+        assert(s.load() > 0.0);
+
+        for (int i = 0; i < 5; ++i) {
+                s.erase(i);
+                assert(s.find(i) == s.end());
+        }
+        assert(s.size() == 0);
+        assert(s.load() == 0.0);
+}
+
+void test_find_many()
+{
+        cout << __func__ << endl;
+
+        hash_set<int> s;
+        unordered_set<int> ctrl;
+        for (size_t i = 0; i < 1000; ++i) {
+                int val = rand() % 4000;
+                s.insert(val);
+                ctrl.insert(val);
+        }
+
+        // odd length so the last batch and the last bitmap word are both partial
+        vector<int> keys;
+        for (size_t i = 0; i < 2001; ++i) {
+                keys.push_back(rand() % 4000);
+        }
+
+        vector<hash_set<int>::iterator> its(keys.size());
+        s.find_many(keys.data(), keys.size(), its.data());
+
+        vector<uint64_t> bits((keys.size() + 63) / 64, ~uint64_t{0});
+        s.contains_many(keys.data(), keys.size(), bits.data());
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+                bool present = ctrl.find(keys[i]) != ctrl.end();
+                assert(its[i] == s.find(keys[i]));
+                assert(present == (its[i] != s.end()));
+                assert(present == ((bits[i / 64] >> (i % 64)) & 1));
+        }
+}
+
+void test_churn()
+{
+        cout << __func__ << endl;
+
+        unordered_set<int> ctrl;
+        hash_set<int> s;
+        vector<int> live;
+
+        for (size_t i = 0; i < 200; ++i) {
+                int val = rand();
+                if (ctrl.insert(val).second) {
+                        live.push_back(val);
+                }
+                s.insert(val);
+        }
+
+        // steady state insert/erase churn at a constant size should only ever purge tombstones
+        // in place, never grow the table
+        const size_t cap = s.capacity();
+        for (size_t i = 0; i < 100000; ++i) {
+                size_t victim = rand() % live.size();
+                s.erase(live[victim]);
+                ctrl.erase(live[victim]);
+                live[victim] = live.back();
+                live.pop_back();
+
+                int val = rand();
+                if (ctrl.insert(val).second) {
+                        live.push_back(val);
+                }
+                s.insert(val);
+
+                assert(s.size() == ctrl.size());
+                assert(s.capacity() == cap);
+        }
+
+        for (const auto v : ctrl) {
+                assert(s.find(v) != s.end());
+        }
+
+        for (const auto v : s) {
+                assert(ctrl.find(v) != ctrl.end());
+        }
+}
+
+void test_map()
+{
+        cout << __func__ << endl;
+
+        hash_map<int, int> m;
+        unordered_map<int, int> ctrl;
+
+        for (size_t i = 0; i < 1000; ++i) {
+                int key = rand() % 500;
+                int val = rand();
+
+                switch (rand() % 4) {
+                case 0:
+                        m[key] = val;
+                        ctrl[key] = val;
+                        break;
+                case 1: {
+                        auto res = m.try_emplace(key, val);
+                        auto ctrl_res = ctrl.emplace(key, val);
+                        assert(res.second == ctrl_res.second);
+                        assert((*res.first).second == ctrl_res.first->second);
+                        break;
+                }
+                case 2: {
+                        auto res = m.insert_or_assign(key, val);
+                        assert(res.second == (ctrl.find(key) == ctrl.end()));
+                        ctrl[key] = val;
+                        break;
+                }
+                case 3:
+                        m.erase(key);
+                        ctrl.erase(key);
+                        break;
+                }
+
+                assert(m.size() == ctrl.size());
+        }
+
+        for (const auto& kv : ctrl) {
+                assert(m.at(kv.first) == kv.second);
+                assert(m[kv.first] == kv.second);
+        }
+
+        for (const auto& kv : m) {
+                assert(ctrl.at(kv.first) == kv.second);
+        }
+
+        bool threw = false;
+        try {
+                m.at(-1);
+        } catch (const std::out_of_range&) {
+                threw = true;
+        }
+        assert(threw);
+
+        // operator[] default constructs, and keys/values that aren't trivial survive a resize
+        hash_map<string, string> sm;
+        for (int i = 0; i < 100; ++i) {
+                sm[to_string(i)] += "x";
+                sm[to_string(i)] += to_string(i);
+        }
+        assert(sm.size() == 100);
+        for (int i = 0; i < 100; ++i) {
+                assert(sm.at(to_string(i)) == "x" + to_string(i));
+        }
+}
+
+template <size_t W>
+void check_widths()
+{
+        unordered_set<int> ctrl;
+        hash_set<int, hash<int>, equal_to<int>, allocator<int>, W> s;
+        assert(s.capacity() % W == 0);
+
+        for (size_t i = 0; i < 2000; ++i) {
+                int val = rand() % 3000;
+                if (rand() % 3 == 0) {
+                        ctrl.erase(val);
+                        s.erase(val);
+                } else {
+                        ctrl.insert(val);
+                        s.insert(val);
+                }
+                assert(s.size() == ctrl.size());
+        }
+
+        for (const auto v : ctrl) {
+                assert(s.find(v) != s.end());
+        }
+
+        for (const auto v : s) {
+                assert(ctrl.find(v) != ctrl.end());
+        }
+}
+
+void test_group_kernels()
+{
+        cout << __func__ << endl;
+
+        const group_kernel orig = active_group_kernel();
+        const group_kernel kernels[] = {group_kernel::scalar, group_kernel::sse2,
+                                        group_kernel::avx2, group_kernel::avx512bw};
+
+        alignas(64) uint8_t bytes[64];
+        for (size_t trial = 0; trial < 1000; ++trial) {
+                for (auto& b : bytes) {
+                        // mostly metadata looking values, so matches actually happen
+                        b = rand() % 2 ? rand() % 4 : 0x80 | (rand() % 4);
+                }
+                const uint8_t needle = 0x80 | (rand() % 4);
+
+                assert(set_group_kernel(group_kernel::scalar));
+                const uint64_t want_match = __group<64>::match(bytes, needle);
+                const uint64_t want_empty = __group<16>::match_empty(bytes);
+                const uint64_t want_occupied = __group<32>::match_occupied(bytes);
+
+                for (const auto k : kernels) {
+                        if (!set_group_kernel(k)) {
+                                continue;
+                        }
+                        assert(__group<64>::match(bytes, needle) == want_match);
+                        assert(__group<16>::match_empty(bytes) == want_empty);
+                        assert(__group<32>::match_occupied(bytes) == want_occupied);
+                }
+        }
+
+        for (const auto k : kernels) {
+                if (!set_group_kernel(k)) {
+                        cout << "  skipping " << group_kernel_name(k) << endl;
+                        continue;
+                }
+                check_widths<16>();
+                check_widths<32>();
+                check_widths<64>();
+        }
+
+        set_group_kernel(orig);
+}
+
+// counts live allocations and constructed elements through a shared, stateful tally
+struct alloc_tally {
+        long bytes = 0;
+        long objects = 0;
+        long allocations = 0;
+};
+
+template <typename T>
+struct counting_allocator {
+        using value_type = T;
+
+        alloc_tally * tally;
+
+        explicit counting_allocator(alloc_tally * t) : tally{t}
+        {}
+
+        template <typename U>
+        counting_allocator(const counting_allocator<U>& rhs) : tally{rhs.tally}
+        {}
+
+        T * allocate(size_t n)
+        {
+                tally->bytes += n * sizeof(T);
+                ++tally->allocations;
+                return allocator<T>{}.allocate(n);
+        }
+
+        void deallocate(T * p, size_t n)
+        {
+                tally->bytes -= n * sizeof(T);
+                allocator<T>{}.deallocate(p, n);
+        }
+
+        template <typename U, typename... Ts>
+        void construct(U * p, Ts&& ... args)
+        {
+                ++tally->objects;
+                new (p) U(std::forward<Ts>(args)...);
+        }
+
+        template <typename U>
+        void destroy(U * p)
+        {
+                --tally->objects;
+                p->~U();
+        }
+
+        template <typename U>
+        bool operator==(const counting_allocator<U>& rhs) const
+        {
+                return tally == rhs.tally;
+        }
+
+        template <typename U>
+        bool operator!=(const counting_allocator<U>& rhs) const
+        {
+                return tally != rhs.tally;
+        }
+};
+
+// same thing, but it follows the elements on copy, move and swap
+template <typename T>
+struct propagating_allocator : counting_allocator<T> {
+        using propagate_on_container_copy_assignment = true_type;
+        using propagate_on_container_move_assignment = true_type;
+        using propagate_on_container_swap = true_type;
+
+        explicit propagating_allocator(alloc_tally * t) : counting_allocator<T>{t}
+        {}
+
+        template <typename U>
+        propagating_allocator(const propagating_allocator<U>& rhs) : counting_allocator<T>{rhs}
+        {}
+};
+
+// everything that's equal mod 1000 is the same key
+struct mod_hash {
+        size_t operator()(int v) const
+        {
+                return hash<int>{}(v % 1000);
+        }
+};
+
+struct mod_equal {
+        bool operator()(int a, int b) const
+        {
+                return a % 1000 == b % 1000;
+        }
+};
+
+void test_policies()
+{
+        cout << __func__ << endl;
+
+        alloc_tally tally;
+        {
+                using set_t = hash_set<int, mod_hash, mod_equal, counting_allocator<int>>;
+                set_t s{counting_allocator<int>{&tally}};
+                // nothing until the first insert
+                assert(tally.allocations == 0);
+                assert(s.find(3) == s.end());
+                s.insert(0);
+                assert(tally.allocations == 1);
+
+                for (int i = 0; i < 5000; ++i) {
+                        s.insert(i);
+                }
+                assert(s.size() == 1000);
+                assert(tally.objects == 1000);
+                assert(tally.allocations > 1);
+
+                for (int i = 0; i < 1000; ++i) {
+                        assert(s.find(i + 3000) != s.end());
+                        assert(*s.find(i + 3000) == i);
+                }
+
+                for (int i = 0; i < 500; ++i) {
+                        s.erase(i + 1000);
+                }
+                assert(s.size() == 500);
+                assert(tally.objects == 500);
+
+                set_t other{counting_allocator<int>{&tally}};
+                other.insert(1);
+                s.swap(other);
+                assert(s.size() == 1);
+                assert(other.size() == 500);
+        }
+        assert(tally.bytes == 0);
+        assert(tally.objects == 0);
+
+        {
+                using map_t = hash_map<int, string, mod_hash, mod_equal,
+                                       counting_allocator<pair<const int, string>>>;
+                map_t m{counting_allocator<pair<const int, string>>{&tally}};
+                for (int i = 0; i < 3000; ++i) {
+                        m[i] += "x";
+                }
+                assert(m.size() == 1000);
+                assert(m.at(1) == "xxx");
+                assert(tally.objects == 1000);
+        }
+        assert(tally.bytes == 0);
+        assert(tally.objects == 0);
+}
+
+void test_hashing()
+{
+        cout << __func__ << endl;
+
+        // sequential and strided integers used to pile up in neighbouring groups because
+        // std::hash<int> is the identity
+        hash_set<int> seq;
+        hash_set<int> strided;
+        for (int i = 0; i < 10000; ++i) {
+                seq.insert(i);
+                strided.insert(i * 4096);
+        }
+        assert(seq.__probe_stats().mean < 1.5);
+        assert(strided.__probe_stats().mean < 1.5);
+
+        // contiguous keys go through hash_bytes, which has to see every byte
+        using arr = array<uint32_t, 5>;
+        const ht_hash<arr> h;
+        arr a{{1, 2, 3, 4, 5}};
+        arr b = a;
+        assert(h(a) == h(b));
+        for (size_t i = 0; i < a.size(); ++i) {
+                b = a;
+                ++b[i];
+                assert(h(a) != h(b));
+        }
+
+        hash_set<arr> arrays;
+        for (uint32_t i = 0; i < 1000; ++i) {
+                arrays.insert(arr{{i, i, 0, 0, i}});
+        }
+        assert(arrays.size() == 1000);
+        for (uint32_t i = 0; i < 1000; ++i) {
+                assert(arrays.find(arr{{i, i, 0, 0, i}}) != arrays.end());
+        }
+}
+
+void test_concurrent()
+{
+        cout << __func__ << endl;
+
+        concurrent_hash_set<int> s{16};
+        assert(s.shard_count() == 16);
+
+        // every thread inserts an overlapping range, then erases its own odd numbers
+        const int nthreads = 8;
+        const int per_thread = 5000;
+        vector<thread> threads;
+        for (int t = 0; t < nthreads; ++t) {
+                threads.emplace_back([&s, t] {
+                        for (int i = 0; i < per_thread; ++i) {
+                                s.insert(t * per_thread / 2 + i);
+                        }
+                        for (int i = 0; i < per_thread; ++i) {
+                                int v = t * per_thread / 2 + i;
+                                if (v % 2) {
+                                        s.erase(v);
+                                }
+                                assert(s.contains(t * per_thread / 2) || t % 2);
+                        }
+                });
+        }
+        for (auto& t : threads) {
+                t.join();
+        }
+
+        const int total = (nthreads - 1) * per_thread / 2 + per_thread;
+        assert(s.size() == size_t(total / 2));
+        for (int v = 0; v < total; ++v) {
+                assert(s.contains(v) == (v % 2 == 0));
+        }
+
+        size_t seen = 0;
+        s.for_each([&](int v) {
+                assert(v % 2 == 0);
+                ++seen;
+        });
+        assert(seen == s.size());
+}
+
+struct same_hash {
+        size_t operator()(int) const
+        {
+                return 0;
+        }
+};
+
+// equality that takes a while, so racing inserts overlap more
+struct slow_equal {
+        bool operator()(int a, int b) const
+        {
+                for (volatile int i = 0; i < 100; ++i) {
+                }
+                return a == b;
+        }
+};
+
+void test_lockfree()
+{
+        cout << __func__ << endl;
+
+        const int nthreads = 8;
+        const int per_thread = 20000;
+        const int total = per_thread * 2;
+
+        lockfree_hash_set<int> s{total};
+        assert(s.capacity() >= size_t(total));
+
+        // every value gets inserted by four threads at once, exactly one of them should win
+        atomic<int> wins{0};
+        vector<thread> threads;
+        for (int t = 0; t < nthreads; ++t) {
+                threads.emplace_back([&s, &wins, t] {
+                        int mine = 0;
+                        for (int i = 0; i < per_thread; ++i) {
+                                int v = (t % 2) * per_thread + i;
+                                if (s.insert(v)) {
+                                        ++mine;
+                                }
+                                assert(s.contains(v));
+                        }
+                        wins += mine;
+                });
+        }
+        for (auto& t : threads) {
+                t.join();
+        }
+
+        assert(wins == total);
+        assert(s.size() == size_t(total));
+        for (int v = 0; v < total; ++v) {
+                assert(s.contains(v));
+        }
+        assert(!s.contains(-1));
+        assert(!s.insert(0));
+
+        size_t seen = 0;
+        s.for_each([&](int v) {
+                assert(v >= 0 && v < total);
+                ++seen;
+        });
+        assert(seen == size_t(total));
+
+        lockfree_hash_set<int> tiny{4};
+        bool threw = false;
+        try {
+                for (int i = 0; ; ++i) {
+                        tiny.insert(i);
+                }
+        } catch (const std::length_error&) {
+                threw = true;
+        }
+        assert(threw);
+        assert(tiny.size() == tiny.capacity());
+
+        // Everything on one probe sequence, so groups fill up while other threads are still
+        // looking at them. Each value must still go in exactly once.
+        for (int round = 0; round < 300; ++round) {
+                lockfree_hash_set<int, same_hash, slow_equal> same{256};
+                atomic<int> same_wins{0};
+                vector<thread> racers;
+                for (int t = 0; t < 4; ++t) {
+                        racers.emplace_back([&] {
+                                for (int v = 0; v < 120; ++v) {
+                                        if (same.insert(v)) {
+                                                ++same_wins;
+                                        }
+                                }
+                        });
+                }
+                for (auto& t : racers) {
+                        t.join();
+                }
+                assert(same_wins == 120 && same.size() == 120);
+        }
+}
+
+void test_rcu()
+{
+        cout << __func__ << endl;
+
+        rcu_hash_set<int> s{8};
+        s.update([](hash_set<int>& set) {
+                for (int i = 0; i < 1000; ++i) {
+                        set.insert(i);
+                }
+        });
+
+        // readers always see 0..999 and the snapshot they hold never changes under them, while a
+        // writer keeps adding and removing everything above that
+        const int nreaders = 4;
+        atomic<bool> done{false};
+        vector<thread> threads;
+        for (int t = 0; t < nreaders; ++t) {
+                threads.emplace_back([&s, &done] {
+                        auto r = s.make_reader();
+                        while (!done.load()) {
+                                auto snap = r.lock();
+                                size_t before = snap->size();
+                                for (int i = 0; i < 1000; i += 7) {
+                                        assert(snap->find(i) != snap->end());
+                                }
+                                assert(snap->size() == before);
+                        }
+                        assert(r.contains(999));
+                });
+        }
+
+        for (int round = 0; round < 200; ++round) {
+                s.update([round](hash_set<int>& set) {
+                        if (round % 2) {
+                                for (int i = 1000; i < 1100; ++i) {
+                                        set.erase(i);
+                                }
+                        } else {
+                                for (int i = 1000; i < 1100; ++i) {
+                                        set.insert(i);
+                                }
+                        }
+                });
+        }
+        done = true;
+        for (auto& t : threads) {
+                t.join();
+        }
+
+        auto r = s.make_reader();
+        assert(r.contains(0) && !r.contains(1000));
+        assert(r.lock()->size() == 1000);
+
+        // with nobody reading, every old version can go
+        assert(s.pending_reclaim() == 0);
+
+        // out of reader slots
+        rcu_hash_set<int> small{1};
+        auto only = small.make_reader();
+        bool threw = false;
+        try {
+                small.make_reader();
+        } catch (const std::length_error&) {
+                threw = true;
+        }
+        assert(threw);
+
+        // a held snapshot keeps its table alive
+        {
+                auto snap = only.lock();
+                small.update([](hash_set<int>& set) { set.insert(1); });
+                assert(small.pending_reclaim() == 1);
+                assert(snap->size() == 0);
+        }
+        assert(small.pending_reclaim() == 0);
+        assert(only.contains(1));
+}
+
+void test_incremental()
+{
+        cout << __func__ << endl;
+
+        incremental_hash_set<int> s;
+        unordered_set<int> ref;
+        bool saw_migration = false;
+
+        // keep checking everything while tables are half moved
+        for (int i = 0; i < 20000; ++i) {
+                assert(s.insert(i) == ref.insert(i).second);
+                assert(!s.insert(i));
+                if (i % 3 == 0) {
+                        s.erase(i / 2);
+                        ref.erase(i / 2);
+                }
+                saw_migration |= s.migrating();
+                assert(s.size() == ref.size());
+                assert(s.contains(i) == ref.count(i));
+                assert(s.contains(i / 2) == ref.count(i / 2));
+        }
+        assert(saw_migration);
+
+        for (int i = 0; i < 20000; ++i) {
+                assert(s.contains(i) == ref.count(i));
+        }
+
+        size_t seen = 0;
+        s.for_each([&](int v) {
+                assert(ref.count(v));
+                ++seen;
+        });
+        assert(seen == ref.size());
+
+        // no single insert should move more than groups_per_step groups, so a migration spans
+        // a lot of inserts
+        incremental_hash_set<int> one{16, 1};
+        size_t ops_migrating = 0;
+        for (int i = 0; i < 4096; ++i) {
+                one.insert(i);
+                ops_migrating += one.migrating();
+        }
+        assert(ops_migrating > 128);
+
+        // churn at a fixed size migrates into a same size table instead of growing forever
+        incremental_hash_set<int> churn;
+        for (int i = 0; i < 1000; ++i) {
+                churn.insert(i);
+        }
+        for (int i = 1000; i < 200000; ++i) {
+                churn.insert(i);
+                churn.erase(i - 1000);
+        }
+        assert(churn.size() == 1000);
+        assert(churn.capacity() <= 4096);
+}
+
+void test_capacity()
+{
+        cout << __func__ << endl;
+
+        // big capacities used to get truncated by a 32 bit popcount
+        for (int shift = 4; shift < 48; ++shift) {
+                for (size_t n : {size_t(1) << shift, (size_t(1) << shift) + 1,
+                                 (size_t(1) << shift) * 7 / 10 + 1}) {
+                        const size_t cap = hash_set<int>::__capacity_for(n);
+                        assert((cap & (cap - 1)) == 0);
+                        assert((n - 1) * 10 <= cap * 7);
+                        assert(cap == 16 || (n - 1) * 10 > cap / 2 * 7);
+                }
+        }
+
+        // reserve(n) means n inserts with no resize
+        for (size_t n : {1, 11, 12, 100, 1000, 1434, 1435, 5000}) {
+                hash_set<int> s;
+                s.reserve(n);
+                const size_t cap = s.capacity();
+                for (size_t i = 0; i < n; ++i) {
+                        s.insert(i);
+                }
+                assert(s.capacity() == cap);
+                assert(s.size() == n);
+        }
+
+        // including when there are tombstones around
+        hash_set<int> t;
+        for (int i = 0; i < 1000; ++i) {
+                t.insert(i);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+                t.erase(i);
+        }
+        t.reserve(1500);
+        size_t cap = t.capacity();
+        for (int i = 1000; i < 2000; ++i) {
+                t.insert(i);
+        }
+        assert(t.capacity() == cap && t.size() == 1500);
+
+        // spike then drain
+        hash_set<int> s;
+        for (int i = 0; i < 100000; ++i) {
+                s.insert(i);
+        }
+        const size_t peak = s.capacity();
+        for (int i = 100; i < 100000; ++i) {
+                s.erase(i);
+        }
+        assert(s.capacity() == peak);
+        s.shrink_to_fit();
+        assert(s.capacity() == hash_set<int>::__capacity_for(100));
+        assert(s.size() == 100);
+        for (int i = 0; i < 200; ++i) {
+                assert((s.find(i) != s.end()) == (i < 100));
+        }
+        cap = s.capacity();
+        s.shrink_to_fit();
+        assert(s.capacity() == cap);
+
+        s.rehash(4096);
+        assert(s.capacity() == 4096 && s.size() == 100);
+        s.rehash(0);
+        assert(s.capacity() == cap);
+        hash_set<int> never;
+        never.rehash(0);
+        assert(never.capacity() == 0);
+        for (int i = 0; i < 100; ++i) {
+                assert(s.find(i) != s.end());
+        }
+
+        // shrinking a map keeps the values with their keys
+        hash_map<int, int> m;
+        for (int i = 0; i < 10000; ++i) {
+                m[i] = -i;
+        }
+        for (int i = 10; i < 10000; ++i) {
+                m.erase(i);
+        }
+        m.shrink_to_fit();
+        assert(m.size() == 10);
+        for (int i = 0; i < 10; ++i) {
+                assert(m.at(i) == -i);
+        }
+}
+
+template <typename S, typename F>
+static void check_copies(F make)
+{
+        S a;
+        for (int i = 0; i < 5000; ++i) {
+                a.insert(make(i));
+        }
+        for (int i = 0; i < 5000; i += 3) {
+                a.erase(make(i));
+        }
+
+        S b{a};
+        assert(b.size() == a.size() && b.capacity() == a.capacity());
+        for (int i = 0; i < 5000; ++i) {
+                assert((b.find(make(i)) != b.end()) == (i % 3 != 0));
+        }
+
+        // copies are independent
+        b.insert(make(0));
+        a.erase(make(1));
+        assert(a.find(make(0)) == a.end() && b.find(make(1)) != b.end());
+
+        // assigning over a table of the same capacity and of a different one
+        S c;
+        for (int i = 0; i < 5000; ++i) {
+                c.insert(make(-i));
+        }
+        c = a;
+        assert(c.size() == a.size());
+        S d;
+        d = a;
+        assert(d.size() == a.size());
+        for (int i = 0; i < 5000; ++i) {
+                const bool there = i % 3 != 0 && i != 1;
+                assert((c.find(make(i)) != c.end()) == there);
+                assert((d.find(make(i)) != d.end()) == there);
+        }
+        S& self = d;
+        d = self;
+        assert(d.size() == a.size());
+
+        S e{std::move(d)};
+        assert(e.size() == a.size() && d.size() == 0);
+        assert(e.find(make(2)) != e.end());
+        d = std::move(e);
+        assert(d.find(make(2)) != d.end());
+
+        // a copy keeps working as it grows
+        for (int i = 5000; i < 20000; ++i) {
+                b.insert(make(i));
+        }
+        for (int i = 0; i < 20000; ++i) {
+                assert((b.find(make(i)) != b.end()) == (i >= 5000 || i % 3 != 0 || i == 0));
+        }
+}
+
+void test_copy()
+{
+        cout << __func__ << endl;
+
+        static_assert(hash_set_mem<int>::trivial_copy, "int should be memcpy-able");
+        static_assert(!hash_set_mem<string>::trivial_copy, "string shouldn't be");
+        static_assert(!hash_set_mem<int, 16, counting_allocator<int>>::trivial_destroy,
+                      "counting_allocator wants to see every destroy");
+
+        // a move only swaps pointers, unless the elements live in the table's inline group
+        struct throwing_move {
+                int v;
+                throwing_move(throwing_move&& o) : v(o.v) {}
+        };
+        static_assert(std::is_nothrow_move_constructible<hash_set<int>>::value, "");
+        static_assert(std::is_nothrow_move_assignable<hash_map<int, string>>::value, "");
+        static_assert(std::is_nothrow_move_constructible<node_hash_set<string>>::value, "");
+        static_assert(std::is_nothrow_move_constructible<small_hash_set<int>>::value, "");
+        static_assert(!std::is_nothrow_move_constructible<
+                              small_hash_set<throwing_move, same_hash>>::value, "");
+        // and the functors have to come along without throwing
+        struct throwing_copy_hash {
+                throwing_copy_hash() = default;
+                throwing_copy_hash(const throwing_copy_hash&) {}
+                size_t operator()(int) const { return 0; }
+        };
+        static_assert(!std::is_nothrow_move_constructible<
+                              hash_set<int, throwing_copy_hash>>::value, "");
+        static_assert(!std::is_nothrow_move_assignable<
+                              hash_set<int, throwing_copy_hash>>::value, "");
+
+        check_copies<hash_set<int>>([](int i) { return i; });
+        check_copies<hash_set<string>>([](int i) { return to_string(i); });
+
+        // elements get copied through the allocator, and all of them get cleaned up
+        using set_t = hash_set<int, ht_hash<int>, equal_to<int>, counting_allocator<int>>;
+        alloc_tally tally;
+        {
+                set_t s{counting_allocator<int>{&tally}};
+                for (int i = 0; i < 1000; ++i) {
+                        s.insert(i);
+                }
+                set_t copy{s};
+                assert(tally.objects == 2000);
+                assert(copy.get_allocator().tally == &tally);
+                copy = s;
+                assert(tally.objects == 2000);
+        }
+        assert(tally.objects == 0 && tally.bytes == 0);
+
+        hash_map<int, string> m;
+        for (int i = 0; i < 1000; ++i) {
+                m[i] = to_string(i);
+        }
+        hash_map<int, string> m2{m};
+        m2[0] = "zero";
+        assert(m.at(0) == "0" && m2.at(0) == "zero" && m2.at(999) == "999");
+}
+
+// Two tables on different arenas, i.e. allocators that aren't equal. Every element has to be
+// built and torn down by the same arena, which the tallies check by coming back to zero.
+template <typename A>
+static void check_unequal_allocators(bool propagates, size_t n)
+{
+        using set_t = small_hash_set<int, ht_hash<int>, equal_to<int>, A>;
+        alloc_tally ta, tb;
+        {
+                set_t a{A{&ta}};
+                set_t b{A{&tb}};
+                for (size_t i = 0; i < n; ++i) {
+                        a.insert(i);
+                        b.insert(i + n);
+                }
+
+                a = b;
+                assert(a.get_allocator().tally == (propagates ? &tb : &ta));
+                assert(a.size() == n && a.contains(n) && !a.contains(0));
+                assert(ta.objects + tb.objects == long(2 * n));
+
+                a.insert(0);
+                a = std::move(b);
+                assert(a.get_allocator().tally == (propagates ? &tb : &ta));
+                assert(a.size() == n && a.contains(n) && !a.contains(0));
+                if (!propagates) {
+                        // the elements came over one at a time, and b let go of its own
+                        assert(ta.objects == long(n) && tb.objects == 0);
+                }
+
+                if (propagates) {
+                        set_t c{A{&ta}};
+                        c.insert(-1);
+                        swap(a, c);
+                        assert(a.get_allocator().tally == &ta && c.get_allocator().tally == &tb);
+                        assert(a.size() == 1 && c.size() == n && c.contains(n));
+                        assert(ta.objects == 1);
+                }
+        }
+        assert(ta.objects == 0 && ta.bytes == 0 && tb.objects == 0 && tb.bytes == 0);
+}
+
+void test_allocator_propagation()
+{
+        cout << __func__ << endl;
+
+        // 4 fit in the inline group, 100 don't
+        for (size_t n : {4, 100}) {
+                check_unequal_allocators<counting_allocator<int>>(false, n);
+                check_unequal_allocators<propagating_allocator<int>>(true, n);
+        }
+}
+
+struct big_value {
+        int key;
+        char payload[252];
+
+        bool operator==(const big_value& rhs) const
+        {
+                return key == rhs.key;
+        }
+};
+
+struct big_value_hash {
+        size_t operator()(const big_value& v) const
+        {
+                return v.key;
+        }
+};
+
+void test_nodes()
+{
+        cout << __func__ << endl;
+
+        static_assert(!hash_set<int>::__uses_node_storage, "small stays flat");
+        static_assert(hash_set<big_value, big_value_hash>::__uses_node_storage,
+                      "big goes to nodes on its own");
+        static_assert(!hash_set<big_value, big_value_hash, equal_to<big_value>,
+                                allocator<big_value>, 16, slot_storage::flat>::__uses_node_storage,
+                      "unless asked not to");
+        static_assert(node_hash_set<int>::__uses_node_storage, "or asked to");
+
+        // pointers stay good while the table grows, purges tombstones and shrinks
+        node_hash_set<int> s;
+        vector<const int *> ptrs;
+        for (int i = 0; i < 1000; ++i) {
+                ptrs.push_back(&*s.insert(i).first);
+        }
+        for (int i = 1000; i < 100000; ++i) {
+                s.insert(i);
+        }
+        for (int i = 1000; i < 100000; ++i) {
+                s.erase(i);
+        }
+        s.shrink_to_fit();
+        s.rehash(0);
+        for (int i = 0; i < 1000; ++i) {
+                assert(&*s.find(i) == ptrs[i]);
+        }
+
+        // copies get their own nodes
+        node_hash_set<int> copy{s};
+        assert(copy.size() == 1000);
+        assert(&*copy.find(5) != ptrs[5]);
+        copy.erase(5);
+        assert(s.find(5) != s.end() && copy.find(5) == copy.end());
+
+        hash_set<big_value, big_value_hash> big;
+        for (int i = 0; i < 2000; ++i) {
+                big_value v{};
+                v.key = i;
+                v.payload[0] = char(i);
+                big.insert(v);
+        }
+        for (int i = 0; i < 2000; i += 2) {
+                big_value v{};
+                v.key = i;
+                big.erase(v);
+        }
+        assert(big.size() == 1000);
+        for (auto& v : big) {
+                assert(v.key % 2 == 1 && v.payload[0] == char(v.key));
+        }
+
+        node_hash_map<int, string> m;
+        string * p = &m[7];
+        *p = "seven";
+        for (int i = 0; i < 10000; ++i) {
+                m[i + 100] = to_string(i);
+        }
+        assert(&m.at(7) == p && m.at(7) == "seven");
+
+        // nodes and slots both go through the allocator, and all of it comes back
+        using set_t = node_hash_set<int, ht_hash<int>, equal_to<int>, counting_allocator<int>>;
+        alloc_tally tally;
+        {
+                set_t t{counting_allocator<int>{&tally}};
+                for (int i = 0; i < 1000; ++i) {
+                        t.insert(i);
+                }
+                for (int i = 0; i < 500; ++i) {
+                        t.erase(i);
+                }
+                // one node and one slot pointer per element
+                assert(tally.objects == 1000);
+                set_t other{t};
+                assert(tally.objects == 2000);
+                t.shrink_to_fit();
+                assert(tally.objects == 2000);
+        }
+        assert(tally.objects == 0 && tally.bytes == 0);
+}
+
+template <typename S, typename F>
+static void check_small_swaps(F make)
+{
+        // inline <-> inline, inline <-> heap, and back
+        S a, b, big;
+        for (int i = 0; i < 5; ++i) {
+                a.insert(make(i));
+                b.insert(make(100 + i));
+        }
+        for (int i = 0; i < 1000; ++i) {
+                big.insert(make(1000 + i));
+        }
+
+        a.swap(b);
+        assert(a.size() == 5 && b.size() == 5);
+        assert(a.find(make(100)) != a.end() && a.find(make(0)) == a.end());
+        assert(b.find(make(4)) != b.end() && b.find(make(104)) == b.end());
+
+        a.swap(big);
+        assert(a.size() == 1000 && big.size() == 5);
+        assert(a.find(make(1999)) != a.end() && big.find(make(104)) != big.end());
+        big.swap(a);
+        assert(big.size() == 1000 && a.size() == 5);
+        assert(a.find(make(102)) != a.end() && big.find(make(1000)) != big.end());
+
+        S moved{std::move(a)};
+        assert(moved.size() == 5 && a.size() == 0);
+        assert(moved.find(make(101)) != moved.end());
+        a.insert(make(7));
+        assert(a.size() == 1);
+
+        S copy{moved};
+        assert(copy.size() == 5 && copy.find(make(103)) != copy.end());
+
+        // back into the inline group once it fits again
+        for (int i = 1000; i < 1995; ++i) {
+                big.erase(make(i));
+        }
+        big.shrink_to_fit();
+        assert(big.capacity() == 16 && big.size() == 5);
+        for (int i = 1995; i < 2000; ++i) {
+                assert(big.find(make(i)) != big.end());
+        }
+}
+
+void test_small()
+{
+        cout << __func__ << endl;
+
+        // empty tables don't allocate, and everything read-only works on them
+        alloc_tally tally;
+        {
+                using set_t = hash_set<int, ht_hash<int>, equal_to<int>, counting_allocator<int>>;
+                set_t s{counting_allocator<int>{&tally}};
+                assert(s.capacity() == 0 && s.size() == 0);
+                assert(s.find(1) == s.end() && s.begin() == s.end());
+                s.erase(1);
+                uint64_t found = 1;
+                int keys[] = {1, 2, 3};
+                s.contains_many(keys, 3, &found);
+                assert(found == 0);
+                s.shrink_to_fit();
+                set_t copy{s};
+                set_t moved{std::move(copy)};
+                assert(tally.allocations == 0);
+
+                s.reserve(100);
+                assert(tally.allocations == 1 && s.capacity() >= 100);
+        }
+        assert(tally.bytes == 0);
+
+        hash_map<int, int> m;
+        assert(m.capacity() == 0);
+        m[1] = 2;
+        assert(m.at(1) == 2 && m.capacity() > 0);
+
+        // with an inline group, small sets don't allocate at all
+        alloc_tally small_tally;
+        {
+                using set_t = small_hash_set<int, ht_hash<int>, equal_to<int>,
+                                             counting_allocator<int>>;
+                set_t s{counting_allocator<int>{&small_tally}};
+                assert(s.capacity() == 16);
+                for (int i = 0; i < 12; ++i) {
+                        s.insert(i);
+                }
+                for (int i = 0; i < 12; ++i) {
+                        assert(s.find(i) != s.end());
+                }
+                assert(small_tally.allocations == 0 && small_tally.objects == 12);
+                s.insert(12);
+                assert(small_tally.allocations == 1 && s.capacity() > 16);
+                for (int i = 0; i < 13; ++i) {
+                        assert(s.find(i) != s.end());
+                }
+        }
+        assert(small_tally.bytes == 0 && small_tally.objects == 0);
+
+        check_small_swaps<small_hash_set<int>>([](int i) { return i; });
+        check_small_swaps<small_hash_set<string>>([](int i) { return to_string(i); });
+
+        small_hash_map<int, string> sm;
+        for (int i = 0; i < 100; ++i) {
+                sm[i] = to_string(i);
+        }
+        for (int i = 0; i < 100; ++i) {
+                assert(sm.at(i) == to_string(i));
+        }
+}
+
+// counts how often the table calls into the user's hash and equality
+struct call_counts {
+        size_t hashes = 0;
+        size_t compares = 0;
+};
+
+struct counted_hash {
+        call_counts * counts;
+
+        size_t operator()(int v) const
+        {
+                ++counts->hashes;
+                return hash<int>{}(v);
+        }
+};
+
+struct counted_equal {
+        call_counts * counts;
+
+        bool operator()(int a, int b) const
+        {
+                ++counts->compares;
+                return a == b;
+        }
+};
+
+void test_stored_hash()
+{
+        cout << __func__ << endl;
+
+        static_assert(sizeof(*stored_hash_set<int>{}.begin()) == sizeof(int), "slots look the same");
+
+        call_counts counts;
+        stored_hash_set<int, counted_hash, counted_equal> s{0, counted_hash{&counts},
+                                                            counted_equal{&counts}};
+
+        // one hash per insert, no matter how many times the table grows
+        const int n = 10000;
+        for (int i = 0; i < n; ++i) {
+                s.insert(i);
+        }
+        assert(s.size() == n && counts.hashes == n && counts.compares == 0);
+
+        // and a hit only compares against the key it's looking for
+        counts = call_counts{};
+        for (int i = 0; i < n; ++i) {
+                assert(s.find(i) != s.end());
+        }
+        assert(counts.hashes == n && counts.compares == n);
+
+        // misses don't compare keys at all
+        counts = call_counts{};
+        for (int i = n; i < 2 * n; ++i) {
+                assert(s.find(i) == s.end());
+        }
+        assert(counts.compares == 0);
+
+        // purging tombstones and shrinking don't rehash either
+        for (int i = 0; i < n; i += 2) {
+                s.erase(i);
+        }
+        counts = call_counts{};
+        s.rehash(0);
+        s.shrink_to_fit();
+        assert(counts.hashes == 0);
+        for (int i = 0; i < n; ++i) {
+                assert((s.find(i) != s.end()) == (i % 2 == 1));
+        }
+
+        // copies keep the stored hashes
+        auto copy = s;
+        counts = call_counts{};
+        copy.reserve(4 * n);
+        assert(counts.hashes == 0);
+        for (int i = 1; i < n; i += 2) {
+                assert(copy.find(i) != copy.end());
+        }
+
+        // with nodes, the hash goes next to the pointer
+        static_assert(hash_set<big_value, big_value_hash, equal_to<big_value>,
+                               allocator<big_value>, 16, slot_storage::automatic, false,
+                               true>::__uses_node_storage, "stored hashes and nodes mix");
+        stored_hash_set<big_value, big_value_hash> big;
+        for (int i = 0; i < 1000; ++i) {
+                big_value v{};
+                v.key = i;
+                v.payload[0] = char(i);
+                big.insert(v);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+                big_value v{};
+                v.key = i;
+                big.erase(v);
+        }
+        for (auto& v : big) {
+                assert(v.key % 2 == 1 && v.payload[0] == char(v.key));
+        }
+
+        stored_hash_map<string, string> m;
+        for (int i = 0; i < 1000; ++i) {
+                m[to_string(i)] = to_string(i * 2);
+        }
+        for (int i = 0; i < 1000; ++i) {
+                assert(m.at(to_string(i)) == to_string(i * 2));
+        }
+        assert(m.find("1000") == m.end());
+}
+
+void test_precomputed_hash()
+{
+        cout << __func__ << endl;
+
+        // one hash for the key, fed to a few tables that all seed it differently
+        hash_set<string> dedup, tenant;
+        hash_map<string, int> global;
+        tenant.insert("x");
+        const auto h = dedup.hash_function();
+        for (int i = 0; i < 1000; ++i) {
+                const string key = to_string(i % 500);
+                const size_t hash = h(key);
+                if (!dedup.insert(key, hash).second) {
+                        continue;
+                }
+                if (i % 2 == 0) {
+                        tenant.insert(key, hash);
+                }
+                global.insert(make_pair(key, i), hash);
+        }
+        assert(dedup.size() == 500 && tenant.size() == 251 && global.size() == 500);
+
+        for (int i = 0; i < 600; ++i) {
+                const string key = to_string(i);
+                const size_t hash = h(key);
+                assert((dedup.find(key, hash) != dedup.end()) == (i < 500));
+                assert((tenant.find(key, hash) != tenant.end()) == (i < 500 && i % 2 == 0));
+                // and the plain overloads agree
+                assert(dedup.find(key, hash) == dedup.find(key));
+                auto it = static_cast<const hash_map<string, int>&>(global).find(key, hash);
+                assert((it != global.end()) == (i < 500));
+        }
+
+        for (int i = 0; i < 500; i += 3) {
+                const string key = to_string(i);
+                dedup.erase(key, h(key));
+        }
+        assert(dedup.size() == 500 - 167);
+        assert(dedup.find("0") == dedup.end() && dedup.find("1") != dedup.end());
+}
+
+// can't be built from an int, so lookups by int only compile if they're really transparent
+struct boxed_int {
+        explicit boxed_int(int v) : v(v) {}
+        int v;
+};
+
+struct boxed_hash {
+        using is_transparent = void;
+
+        size_t operator()(const boxed_int& b) const
+        {
+                return hash<int>{}(b.v);
+        }
+
+        size_t operator()(int v) const
+        {
+                return hash<int>{}(v);
+        }
+};
+
+struct boxed_equal {
+        using is_transparent = void;
+
+        bool operator()(const boxed_int& a, const boxed_int& b) const
+        {
+                return a.v == b.v;
+        }
+
+        bool operator()(int a, const boxed_int& b) const
+        {
+                return a == b.v;
+        }
+};
+
+void test_transparent()
+{
+        cout << __func__ << endl;
+
+        hash_set<boxed_int, boxed_hash, boxed_equal> boxes;
+        for (int i = 0; i < 100; ++i) {
+                boxes.insert(boxed_int{i});
+        }
+        assert(boxes.find(5) != boxes.end() && (*boxes.find(5)).v == 5);
+        assert(boxes.find(100) == boxes.end());
+        assert(boxes.contains(99) && !boxes.contains(-1));
+        assert(boxes.count(7) == 1 && boxes.count(700) == 0);
+        boxes.erase(7);
+        assert(!boxes.contains(7) && boxes.size() == 99);
+        const auto& cboxes = boxes;
+        assert(cboxes.find(8) != cboxes.end());
+
+        // strings, looked up by string_view and const char *
+        hash_set<string, ht_hash<string>, equal_to<>> strs;
+        for (int i = 0; i < 100; ++i) {
+                strs.insert("a fairly long string that won't fit in SSO " + to_string(i));
+        }
+        const string needle = "a fairly long string that won't fit in SSO 42";
+        assert(strs.contains(string_view{needle}));
+        assert(strs.find(needle.c_str()) != strs.end());
+        assert(strs.count(string_view{needle}.substr(0, 10)) == 0);
+        strs.erase(string_view{needle});
+        assert(!strs.contains(needle) && strs.size() == 99);
+
+        hash_map<string, int, ht_hash<string>, equal_to<>> m;
+        m["one"] = 1;
+        assert(m.find(string_view{"one"}) != m.end() && m.contains("one"));
+
+        // without transparent functors, the plain key_type overloads still take anything that
+        // converts
+        hash_set<string> plain;
+        plain.insert("x");
+        assert(plain.contains("x") && plain.count("y") == 0);
+}
+
+template <typename F>
+static void expect_throw(F f)
+{
+        bool threw = false;
+        try {
+                f();
+        } catch (const runtime_error&) {
+                threw = true;
+        }
+        assert(threw);
+}
+
+// every constructor throws while armed, and live counts what's around to be destroyed
+struct boom {
+        static bool armed;
+        static long live;
+        int v;
+
+        boom() : boom(0)
+        {}
+
+        explicit boom(int x) : v{x}
+        {
+                if (armed) {
+                        throw runtime_error{"boom"};
+                }
+                ++live;
+        }
+
+        boom(const boom& rhs) : boom(rhs.v)
+        {}
+
+        boom& operator=(const boom&) = default;
+
+        ~boom()
+        {
+                --live;
+        }
+};
+
+bool boom::armed = false;
+long boom::live = 0;
+
+// a failed insert leaves nothing behind, in particular no slot that gets destroyed later
+template <typename Map>
+static void check_throwing_ctor()
+{
+        {
+                Map m;
+                for (int i = 0; i < 100; ++i) {
+                        m.try_emplace(i, i);
+                }
+                const boom b{7};
+                const typename Map::value_type p{1003, b};
+
+                boom::armed = true;
+                expect_throw([&] { m.try_emplace(1000, 1); });
+                expect_throw([&] { m[1001]; });
+                expect_throw([&] { m.insert_or_assign(1002, b); });
+                expect_throw([&] { m.insert(p); });
+                expect_throw([&] { m.emplace(1004, 1); });
+                boom::armed = false;
+
+                assert(m.size() == 100);
+                assert(size_t(std::distance(m.begin(), m.end())) == 100);
+                for (int i = 1000; i <= 1004; ++i) {
+                        assert(!m.contains(i));
+                        assert(m.try_emplace(i, i).second);
+                }
+                assert(m.size() == 105 && m.at(1002).v == 1002);
+        }
+        assert(boom::live == 0);
+}
+
+void test_throwing_ctor()
+{
+        cout << __func__ << endl;
+
+        check_throwing_ctor<hash_map<int, boom>>();
+        check_throwing_ctor<node_hash_map<int, boom>>();
+        check_throwing_ctor<stored_hash_map<int, boom>>();
+}
+
+void test_snapshot()
+{
+        cout << __func__ << endl;
+
+        char path[] = "/tmp/ht_snapshotXXXXXX";
+        const int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+
+        // with some tombstones in it, so lookups have to walk past them on the mapped pages too
+        hash_set<uint64_t> s;
+        for (uint64_t i = 0; i < 100000; ++i) {
+                s.insert(i * 7);
+        }
+        for (uint64_t i = 0; i < 100000; i += 3) {
+                s.erase(i * 7);
+        }
+        s.save(path);
+
+        {
+                mapped_hash_set<hash_set<uint64_t>> m{path, true};
+                assert(m.size() == s.size() && m.capacity() == s.capacity());
+                for (uint64_t i = 0; i < 100000; ++i) {
+                        assert(m.contains(i * 7) == (i % 3 != 0));
+                        assert(!m.contains(i * 7 + 1));
+                }
+                size_t n = 0;
+                for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+                        assert(s.contains(*it));
+                }
+                assert(n == s.size());
+
+                // a copy of the view is a normal set again
+                hash_set<uint64_t> copy{m.set()};
+                copy.insert(1);
+                assert(copy.size() == s.size() + 1);
+        }
+
+        // maps too
+        hash_map<uint32_t, uint32_t> hm;
+        for (uint32_t i = 0; i < 1000; ++i) {
+                hm[i] = i * i;
+        }
+        hm.save(path);
+        {
+                mapped_hash_set<hash_map<uint32_t, uint32_t>> m{path};
+                for (uint32_t i = 0; i < 1000; ++i) {
+                        assert((*m.find(i)).second == i * i);
+                }
+        }
+
+        // an empty table has no block at all
+        hash_set<uint64_t>{}.save(path);
+        {
+                mapped_hash_set<hash_set<uint64_t>> m{path, true};
+                assert(m.size() == 0 && m.begin() == m.end() && !m.contains(0));
+        }
+
+        // refuses files from a different kind of table, or that got damaged
+        s.save(path);
+        expect_throw([&] { mapped_hash_set<hash_set<uint32_t>> m{path}; });
+        using wide_t = hash_set<uint64_t, ht_hash<uint64_t>, equal_to<uint64_t>,
+                                allocator<uint64_t>, 32>;
+        expect_throw([&] { mapped_hash_set<wide_t> m{path}; });
+        using tri_t = hash_set<uint64_t, ht_hash<uint64_t>, equal_to<uint64_t>,
+                               allocator<uint64_t>, 16, slot_storage::automatic, false, false,
+                               triangular_probing>;
+        expect_throw([&] { mapped_hash_set<tri_t> m{path}; });
+        {
+                FILE * f = fopen(path, "r+b");
+                fseek(f, sizeof(__ht_file_header) + 100, SEEK_SET);
+                fputc(0x55, f);
+                fclose(f);
+        }
+        mapped_hash_set<hash_set<uint64_t>> unchecked{path};
+        expect_throw([&] { mapped_hash_set<hash_set<uint64_t>> m{path, true}; });
+        // a missing end byte is caught even without the checksum
+        s.save(path);
+        {
+                FILE * f = fopen(path, "r+b");
+                fseek(f, sizeof(__ht_file_header) + s.capacity(), SEEK_SET);
+                fputc(0, f);
+                fclose(f);
+        }
+        expect_throw([&] { mapped_hash_set<hash_set<uint64_t>> m{path}; });
+        // a capacity that can't be real is turned down before any size gets worked out from it,
+        // and the error says which file
+        s.save(path);
+        {
+                FILE * f = fopen(path, "r+b");
+                const uint64_t huge = ~uint64_t{0};
+                fseek(f, offsetof(__ht_file_header, capacity), SEEK_SET);
+                fwrite(&huge, sizeof(huge), 1, f);
+                fclose(f);
+        }
+        bool named = false;
+        try {
+                mapped_hash_set<hash_set<uint64_t>> m{path};
+        } catch (const runtime_error& e) {
+                named = strstr(e.what(), path) && strstr(e.what(), "corrupt header");
+        }
+        assert(named);
+        assert(truncate(path, 100) == 0);
+        expect_throw([&] { mapped_hash_set<hash_set<uint64_t>> m{path}; });
+        expect_throw([&] { mapped_hash_set<hash_set<uint64_t>> m{"/nonexistent/snapshot"}; });
+
+        unlink(path);
+}
+
+void test_frozen()
+{
+        cout << __func__ << endl;
+
+        frozen_hash_set<int> empty;
+        assert(empty.size() == 0 && empty.begin() == empty.end() && !empty.contains(0));
+
+        frozen_hash_set<int> one{42};
+        assert(one.size() == 1 && one.contains(42) && !one.contains(41));
+        assert(*one.find(42) == 42 && one.find(0) == one.end());
+
+        for (int n : {2, 11, 12, 13, 16, 17, 100, 1000, 100000}) {
+                // with duplicates, which only get in once
+                vector<int> keys;
+                for (int i = 0; i < n; ++i) {
+                        keys.push_back(i * 3);
+                        keys.push_back(i * 3);
+                }
+                frozen_hash_set<int> s{keys.begin(), keys.end()};
+                assert(s.size() == size_t(n));
+                for (int i = 0; i < 3 * n; ++i) {
+                        assert(s.contains(i) == (i % 3 == 0));
+                        assert(s.count(i) == (i % 3 == 0 ? 1u : 0u));
+                }
+                for (int i = -10; i < 0; ++i) {
+                        assert(!s.contains(i));
+                }
+
+                // every element exactly once
+                vector<int> seen(s.begin(), s.end());
+                sort(seen.begin(), seen.end());
+                assert(seen.size() == size_t(n) && unique(seen.begin(), seen.end()) == seen.end());
+                for (int i = 0; i < n; ++i) {
+                        assert(seen[i] == i * 3);
+                }
+
+                // same keys, same layout
+                frozen_hash_set<int> again{keys.rbegin(), keys.rend()};
+                assert(again.bytes() == s.bytes() && again.load() == s.load());
+        }
+
+        // smaller than the hash_set it replaces
+        vector<uint64_t> big;
+        hash_set<uint64_t> mutable_set;
+        for (uint64_t i = 0; i < 100000; ++i) {
+                big.push_back(i * 0x9e3779b97f4a7c15ull);
+                mutable_set.insert(big.back());
+        }
+        frozen_hash_set<uint64_t> frozen{big.begin(), big.end()};
+        assert(frozen.bytes() < mutable_set.capacity() * (1 + sizeof(uint64_t)));
+        assert(frozen.load() > 0.7);
+
+        frozen_hash_set<string> strs{"allow", "these", "keys", "allow"};
+        assert(strs.size() == 3 && strs.contains("these") && !strs.contains("deny"));
+        frozen_hash_set<string> moved{std::move(strs)};
+        assert(moved.contains("keys") && strs.size() == 0 && !strs.contains("keys"));
+
+        // elements only get built once the layout's settled, and all of them come back
+        alloc_tally tally;
+        {
+                vector<int> keys(1000);
+                iota(keys.begin(), keys.end(), 0);
+                frozen_hash_set<int, ht_hash<int>, equal_to<int>, counting_allocator<int>> s{
+                        keys.begin(), keys.end(), ht_hash<int>{}, equal_to<int>{},
+                        counting_allocator<int>{&tally}};
+                assert(tally.objects == 1000 && s.contains(999));
+        }
+        assert(tally.objects == 0 && tally.bytes == 0);
+
+        // a degenerate hash: two groups' worth of keys on one hash still fits, more can't
+        vector<int> same_keys(32);
+        iota(same_keys.begin(), same_keys.end(), 0);
+        frozen_hash_set<int, same_hash> fits{same_keys.begin(), same_keys.end()};
+        for (int v = 0; v < 40; ++v) {
+                assert(fits.contains(v) == (v < 32));
+        }
+        same_keys.resize(40);
+        iota(same_keys.begin(), same_keys.end(), 0);
+        bool threw = false;
+        try {
+                frozen_hash_set<int, same_hash> f{same_keys.begin(), same_keys.end()};
+        } catch (const std::invalid_argument&) {
+                threw = true;
+        }
+        assert(threw);
+}
+
+template <typename S>
+static void check_erase_if()
+{
+        S s;
+        unordered_set<int> ctrl;
+        for (int i = 0; i < 20000; ++i) {
+                int v = rand();
+                s.insert(v);
+                ctrl.insert(v);
+        }
+
+        size_t threes = 0;
+        for (auto it = ctrl.begin(); it != ctrl.end();) {
+                if (*it % 3 == 0) {
+                        it = ctrl.erase(it);
+                        ++threes;
+                } else {
+                        ++it;
+                }
+        }
+        assert(s.erase_if([](int v) { return v % 3 == 0; }) == threes);
+        assert(s.size() == ctrl.size());
+        for (int v : ctrl) {
+                assert(s.contains(v));
+        }
+        for (int v : s) {
+                assert(v % 3 != 0 && ctrl.count(v));
+        }
+        assert(s.erase_if([](int) { return false; }) == 0);
+
+        // by iterator while walking the table
+        for (auto it = s.begin(); it != s.end();) {
+                if (*it % 2 == 0) {
+                        ctrl.erase(*it);
+                        it = s.erase(it);
+                } else {
+                        ++it;
+                }
+        }
+        assert(s.size() == ctrl.size());
+        for (int v : s) {
+                assert(v % 2 != 0 && ctrl.count(v));
+        }
+
+        assert(s.erase_if([](int) { return true; }) == ctrl.size());
+        assert(s.size() == 0 && s.begin() == s.end());
+        s.insert(7);
+        assert(s.contains(7) && s.size() == 1);
+}
+
+void test_erase_if()
+{
+        cout << __func__ << endl;
+
+        check_erase_if<hash_set<int>>();
+        check_erase_if<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 64>>();
+        check_erase_if<node_hash_set<int>>();
+        check_erase_if<small_hash_set<int>>();
+        check_erase_if<stored_hash_set<int>>();
+
+        // neither form hashes anything
+        call_counts counts;
+        hash_set<int, counted_hash, counted_equal> s{0, counted_hash{&counts},
+                                                     counted_equal{&counts}};
+        for (int i = 0; i < 1000; ++i) {
+                s.insert(i);
+        }
+        counts = call_counts{};
+        s.erase(s.find(5));
+        assert(counts.hashes == 1 && counts.compares == 1);
+        assert(s.erase_if([](int v) { return v < 500; }) == 499);
+        assert(counts.hashes == 1 && s.size() == 500);
+
+        // values come through for maps
+        hash_map<int, string> m;
+        for (int i = 0; i < 100; ++i) {
+                m[i] = to_string(i);
+        }
+        assert(m.erase_if([](const pair<const int, string>& kv) {
+                return kv.second.size() == 1;
+        }) == 10);
+        assert(m.size() == 90 && !m.contains(9) && m.contains(10));
+
+        // A table that's due a tombstone purge gets it at the end of the sweep, not on the next
+        // insert. Everything hashing the same fills whole groups, so erases there leave
+        // tombstones.
+        hash_set<int, same_hash> same;
+        while (!same.__wants_resize() || same.size() < 100) {
+                same.insert(int(same.size()));
+        }
+        const size_t cap = same.capacity();
+        const size_t n = same.size();
+        assert(same.erase_if([](int v) { return v < 160 && v % 4 != 0; }) == 120);
+        assert(same.capacity() == cap && same.load() == same.size() / double(cap));
+        for (size_t i = 0; i < n; ++i) {
+                assert(same.contains(int(i)) == (i >= 160 || i % 4 == 0));
+        }
+}
+
+// every group exactly once before the sequence starts over, from any start
+template <typename Probe, size_t W, bool Pow2 = true>
+static void check_probe_seq(size_t cap)
+{
+        for (size_t start = 0; start < cap; start += cap / 4 + 3) {
+                vector<bool> seen(cap / W);
+                __probe_seq<Probe, W, Pow2> seq{start & ~(W - 1), cap};
+                for (size_t i = 0; i < cap / W; ++i, seq.next()) {
+                        assert(seq.index() == i && seq.offset() % W == 0);
+                        assert(!seen[seq.offset() / W]);
+                        seen[seq.offset() / W] = true;
+                }
+        }
+}
+
+template <typename S>
+static void check_probing_set()
+{
+        S s;
+        unordered_set<int> ctrl;
+        for (int round = 0; round < 4; ++round) {
+                for (int i = 0; i < 20000; ++i) {
+                        const int v = rand() % 50000;
+                        s.insert(v);
+                        ctrl.insert(v);
+                }
+                for (int i = 0; i < 20000; ++i) {
+                        const int v = rand() % 50000;
+                        s.erase(v);
+                        ctrl.erase(v);
+                }
+                assert(s.size() == ctrl.size());
+                for (int v = 0; v < 50000; ++v) {
+                        assert(s.contains(v) == (ctrl.count(v) == 1));
+                }
+        }
+        s.rehash(0);
+        s.shrink_to_fit();
+        for (int v : ctrl) {
+                assert(s.contains(v));
+        }
+        assert(s.__probe_stats().mean >= 1.0);
+
+        // one probe sequence for everything
+        hash_set<int, same_hash, equal_to<int>, allocator<int>, 16, slot_storage::automatic,
+                 false, false, typename S::__probing> same;
+        for (int i = 0; i < 500; ++i) {
+                same.insert(i);
+        }
+        for (int i = 0; i < 500; i += 2) {
+                same.erase(i);
+        }
+        same.rehash(0);
+        for (int i = 0; i < 500; ++i) {
+                assert(same.contains(i) == (i % 2 == 1));
+        }
+}
+
+void test_probing()
+{
+        cout << __func__ << endl;
+
+        check_probe_seq<linear_probing, 16>(16);
+        check_probe_seq<linear_probing, 16>(1024);
+        check_probe_seq<triangular_probing, 16>(16);
+        check_probe_seq<triangular_probing, 16>(1024);
+        check_probe_seq<triangular_probing, 64>(1 << 16);
+        check_probe_seq<linear_probing, 16, false>(48);
+        check_probe_seq<linear_probing, 32, false>(32 * 1001);
+
+        check_probing_set<hash_set<int>>();
+        check_probing_set<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 16,
+                                   slot_storage::automatic, false, false, triangular_probing>>();
+        check_probing_set<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 32,
+                                   slot_storage::node, false, true, triangular_probing>>();
+        hash_map<int, int, ht_hash<int>, equal_to<int>, allocator<pair<const int, int>>, 16,
+                 slot_storage::automatic, false, false, triangular_probing> m;
+        for (int i = 0; i < 1000; ++i) {
+                m[i] = -i;
+        }
+        for (int i = 0; i < 1000; ++i) {
+                assert(m.at(i) == -i);
+        }
+}
+
+void test_compact()
+{
+        cout << __func__ << endl;
+
+        // grows by half each time, and never past what the elements need
+        compact_hash_set<int> s;
+        size_t cap = 0;
+        for (int i = 0; i < 100000; ++i) {
+                s.insert(i);
+                if (s.capacity() != cap) {
+                        assert(s.capacity() % 16 == 0);
+                        assert(cap == 0 || s.capacity() <= cap + cap / 2 + 16);
+                        cap = s.capacity();
+                }
+        }
+        assert(cap < 262144 && (cap & (cap - 1)) != 0);
+        // right after growing it's at 0.7 / 1.5 load, where doubling would leave it at 0.35
+        assert(s.size() / double(cap) > 0.46);
+        hash_set<int> pow2;
+        for (int v : s) {
+                pow2.insert(v);
+        }
+        assert(pow2.capacity() == 262144);
+
+        check_probing_set<compact_hash_set<int>>();
+        check_erase_if<compact_hash_set<int>>();
+        check_sparse_iter<compact_hash_set<int>>();
+        check_sparse_iter<hash_set<int, ht_hash<int>, equal_to<int>, allocator<int>, 64,
+                                   slot_storage::node, false, true, linear_probing,
+                                   compact_sizing>>();
+        check_small_swaps<hash_set<string, ht_hash<string>, equal_to<string>, allocator<string>,
+                                   16, slot_storage::automatic, true, false, linear_probing,
+                                   compact_sizing>>([](int i) { return to_string(i); });
+
+        // reserve gets exactly what's needed, rounded to a group
+        compact_hash_set<uint64_t> r;
+        r.reserve(9000);
+        assert(r.capacity() == 12864
+               && r.capacity() == compact_hash_set<uint64_t>::__capacity_for(9000));
+        for (uint64_t i = 0; i < 9000; ++i) {
+                r.insert(i);
+        }
+        assert(r.capacity() == 12864);
+        r.shrink_to_fit();
+        assert(r.capacity() == 12864);
+
+        compact_hash_map<int, string> m;
+        for (int i = 0; i < 5000; ++i) {
+                m[i] = to_string(i);
+        }
+        auto copy = m;
+        for (int i = 0; i < 5000; ++i) {
+                assert(copy.at(i) == to_string(i));
+        }
+
+        // snapshots say which sizing wrote them
+        char path[] = "/tmp/ht_compactXXXXXX";
+        const int fd = mkstemp(path);
+        assert(fd >= 0);
+        close(fd);
+        r.save(path);
+        {
+                mapped_hash_set<compact_hash_set<uint64_t>> mapped{path, true};
+                assert(mapped.capacity() == 12864);
+                for (uint64_t i = 0; i < 10000; ++i) {
+                        assert(mapped.contains(i) == (i < 9000));
+                }
+        }
+        expect_throw([&] { mapped_hash_set<hash_set<uint64_t>> mapped{path}; });
+        unlink(path);
+}
+
 int main(int argc, char ** argv)
 {
         (void)argc;
@@ -139,4 +2124,29 @@ int main(int argc, char ** argv)
         test_really_basic();
         test_basic();
         test_iter();
+        test_erase_no_tombstone();
+        test_churn();
+        test_find_many();
+        test_map();
+        test_group_kernels();
+        test_policies();
+        test_hashing();
+        test_concurrent();
+        test_lockfree();
+        test_rcu();
+        test_incremental();
+        test_capacity();
+        test_copy();
+        test_allocator_propagation();
+        test_throwing_ctor();
+        test_nodes();
+        test_small();
+        test_stored_hash();
+        test_precomputed_hash();
+        test_transparent();
+        test_snapshot();
+        test_frozen();
+        test_erase_if();
+        test_probing();
+        test_compact();
 }
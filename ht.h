@@ -1,33 +1,365 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <type_traits>
 #include <functional>
+#include <initializer_list>
 #include <utility>
 #include <cstdint>
 #include <memory>
 #include <cassert>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <numeric>
+#include <atomic>
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
 #include <iostream>
 #include <iomanip>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HT_X86 1
 // xxx: not sure which one I need
 #include "emmintrin.h"
 #include "immintrin.h"
+#endif
 
 // TODO:
-// * add an extra byte hanging off the end of the metadata table that dictates "end of table"
-//   so iterators don't have to hold so much crap. They should just be able to store pointer + offset,
-//   maybe even just a pointer with a shift stuffed in the upper bits.
-//
 // * max load factor == 7/8
 //
 // * robin hood hashing == bad bc too many instructions
-//
-// * use C++ allocators
 
-template<typename T>
+// Group scanning kernels. Every probe looks at one aligned group of metadata bytes at a time and
+// wants a bitmap back with bit i set if byte i matches something. The group width is a compile time
+// property of the table (16, 32 or 64 bytes), but which instructions we use to scan a group is
+// picked once at startup from CPUID, so one binary runs everywhere and still uses AVX2/AVX-512 when
+// it's there. All kernels give exactly the same answers, so switching between them (for benchmarks
+// or tests) is fine even while other threads are using tables: they each see the old kernel or the
+// new one.
+enum class group_kernel : uint8_t {
+        scalar,   // portable SWAR, 8 bytes at a time
+        sse2,     // 16 bytes at a time
+        avx2,     // 32 bytes at a time
+        avx512bw, // 64 bytes at a time
+};
+
+inline const char * group_kernel_name(group_kernel k)
+{
+        switch (k) {
+        case group_kernel::scalar: return "scalar";
+        case group_kernel::sse2: return "sse2";
+        case group_kernel::avx2: return "avx2";
+        case group_kernel::avx512bw: return "avx512bw";
+        }
+        return "unknown";
+}
+
+inline group_kernel __detect_group_kernel()
+{
+#ifdef HT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw")) {
+                return group_kernel::avx512bw;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+                return group_kernel::avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+                return group_kernel::sse2;
+        }
+#endif
+        return group_kernel::scalar;
+}
+
+// template so the definitions can live in the header. These are initialized during static init,
+// in no particular order, so each one runs the detection itself, and a table used by some other
+// static initializer might see scalar (the zero value) for a little while, which is slow but still
+// correct. active is atomic since set_group_kernel can change it under threads that are probing.
+// Relaxed loads are plain loads, so the probe loop doesn't pay for that.
+template <typename = void>
+struct __group_kernels
+{
+        static const group_kernel best;
+        static std::atomic<group_kernel> active;
+};
+
+template <typename D>
+const group_kernel __group_kernels<D>::best = __detect_group_kernel();
+
+template <typename D>
+std::atomic<group_kernel> __group_kernels<D>::active{__detect_group_kernel()};
+
+inline group_kernel best_group_kernel()
+{
+        return __group_kernels<>::best;
+}
+
+inline group_kernel active_group_kernel()
+{
+        return __group_kernels<>::active.load(std::memory_order_relaxed);
+}
+
+// Override the kernel picked at startup. Returns false (and changes nothing) if this cpu can't run k.
+inline bool set_group_kernel(group_kernel k)
+{
+        if (k > best_group_kernel()) {
+                return false;
+        }
+        __group_kernels<>::active.store(k, std::memory_order_relaxed);
+        return true;
+}
+
+// low 8 bytes of p, with byte 0 in the low bits
+inline uint64_t __swar_load(const uint8_t * p)
+{
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+}
+
+// collect the top bit of each byte into the low 8 bits. The shifted bits are 8 apart and the
+// multiplier's bits are 7 apart, so every partial product lands in its own bit and there are no
+// carries to worry about.
+inline uint64_t __swar_gather(uint64_t hi)
+{
+        return ((hi >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+// 0x80 in every byte of w that is exactly zero
+inline uint64_t __swar_zero_bytes(uint64_t w)
+{
+        const uint64_t lo7 = 0x7f7f7f7f7f7f7f7full;
+        return ~(((w & lo7) + lo7) | w | lo7);
+}
+
+template <size_t W>
+uint64_t __scalar_match(const uint8_t * p, uint8_t b)
+{
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 8) {
+                uint64_t w = __swar_load(p + i) ^ (b * 0x0101010101010101ull);
+                bitmap |= __swar_gather(__swar_zero_bytes(w)) << i;
+        }
+        return bitmap;
+}
+
+template <size_t W>
+uint64_t __scalar_match_occupied(const uint8_t * p)
+{
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 8) {
+                bitmap |= __swar_gather(__swar_load(p + i) & 0x8080808080808080ull) << i;
+        }
+        return bitmap;
+}
+
+#ifdef HT_X86
+template <size_t W>
+uint64_t __sse2_match(const uint8_t * p, uint8_t b)
+{
+        const __m128i search = _mm_set1_epi8(static_cast<char>(b));
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 16) {
+                const __m128i group = _mm_load_si128(reinterpret_cast<const __m128i *>(p + i));
+                bitmap |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(search, group)))) << i;
+        }
+        return bitmap;
+}
+
+template <size_t W>
+uint64_t __sse2_match_occupied(const uint8_t * p)
+{
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 16) {
+                const __m128i group = _mm_load_si128(reinterpret_cast<const __m128i *>(p + i));
+                bitmap |= uint64_t(uint32_t(_mm_movemask_epi8(group))) << i;
+        }
+        return bitmap;
+}
+
+// These can't be inlined into callers that weren't built for avx2/avx512 themselves, so they cost
+// a call per group unless the whole program is built with -mavx2/-mavx512bw.
+template <size_t W>
+__attribute__((target("avx2")))
+uint64_t __avx2_match(const uint8_t * p, uint8_t b)
+{
+        const __m256i search = _mm256_set1_epi8(static_cast<char>(b));
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 32) {
+                const __m256i group = _mm256_load_si256(reinterpret_cast<const __m256i *>(p + i));
+                bitmap |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(search, group)))) << i;
+        }
+        return bitmap;
+}
+
+template <size_t W>
+__attribute__((target("avx2")))
+uint64_t __avx2_match_occupied(const uint8_t * p)
+{
+        uint64_t bitmap = 0;
+        for (size_t i = 0; i < W; i += 32) {
+                const __m256i group = _mm256_load_si256(reinterpret_cast<const __m256i *>(p + i));
+                bitmap |= uint64_t(uint32_t(_mm256_movemask_epi8(group))) << i;
+        }
+        return bitmap;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline uint64_t __avx512_match(const uint8_t * p, uint8_t b)
+{
+        const __m512i group = _mm512_load_si512(reinterpret_cast<const void *>(p));
+        return _mm512_cmpeq_epi8_mask(_mm512_set1_epi8(static_cast<char>(b)), group);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline uint64_t __avx512_match_occupied(const uint8_t * p)
+{
+        const __m512i group = _mm512_load_si512(reinterpret_cast<const void *>(p));
+        return _mm512_movepi8_mask(group);
+}
+#endif
+
+// One group of W metadata bytes. Kernels narrower than the group just go around more than once,
+// kernels wider than the group fall back to the widest one that fits.
+template <size_t W>
+struct __group
+{
+        static_assert(W == 16 || W == 32 || W == 64, "group width must be 16, 32 or 64");
+
+        static constexpr size_t width = W;
+        static constexpr uint64_t all = W == 64 ? ~uint64_t{0} : (uint64_t{1} << W) - 1;
+
+        // bit i set iff p[i] == b
+        static uint64_t match(const void * p, uint8_t b)
+        {
+                const uint8_t * bytes = static_cast<const uint8_t *>(p);
+#ifdef HT_X86
+                switch (active_group_kernel()) {
+                case group_kernel::avx512bw:
+                        if (W == 64) {
+                                return __avx512_match(bytes, b);
+                        }
+                        /* fallthrough */
+                case group_kernel::avx2:
+                        if (W >= 32) {
+                                return __avx2_match<W>(bytes, b);
+                        }
+                        /* fallthrough */
+                case group_kernel::sse2:
+                        return __sse2_match<W>(bytes, b);
+                case group_kernel::scalar:
+                        break;
+                }
+#endif
+                return __scalar_match<W>(bytes, b);
+        }
+
+        static uint64_t match_empty(const void * p)
+        {
+                return match(p, 0x00);
+        }
+
+        // bit i set iff p[i] has bit 7 set
+        static uint64_t match_occupied(const void * p)
+        {
+                const uint8_t * bytes = static_cast<const uint8_t *>(p);
+#ifdef HT_X86
+                switch (active_group_kernel()) {
+                case group_kernel::avx512bw:
+                        if (W == 64) {
+                                return __avx512_match_occupied(bytes);
+                        }
+                        /* fallthrough */
+                case group_kernel::avx2:
+                        if (W >= 32) {
+                                return __avx2_match_occupied<W>(bytes);
+                        }
+                        /* fallthrough */
+                case group_kernel::sse2:
+                        return __sse2_match_occupied<W>(bytes);
+                case group_kernel::scalar:
+                        break;
+                }
+#endif
+                return __scalar_match_occupied<W>(bytes);
+        }
+
+        // tombstones, never occupied, and anything else without bit 7
+        static uint64_t match_not_occupied(const void * p)
+        {
+                return ~match_occupied(p) & all;
+        }
+};
+
+// Whether allocator A builds and tears down T the default way (placement new and ~T), i.e. it has
+// no construct/destroy of its own that would want to see every element. std::allocator has them
+// before C++20, but they're the default ones.
+template <typename A, typename T, typename = void>
+struct __alloc_has_destroy : std::false_type {};
+
+template <typename A, typename T>
+struct __alloc_has_destroy<A, T, decltype(std::declval<A&>().destroy(std::declval<T *>()))>
+        : std::true_type {};
+
+template <typename A, typename T, typename = void>
+struct __alloc_has_construct : std::false_type {};
+
+template <typename A, typename T>
+struct __alloc_has_construct<A, T, decltype(std::declval<A&>().construct(std::declval<T *>(),
+                                                                          std::declval<const T&>()))>
+        : std::true_type {};
+
+template <typename A, typename T>
+struct __alloc_is_plain
+        : std::integral_constant<bool, std::is_same<A, std::allocator<T>>::value
+                                       || (!__alloc_has_destroy<A, T>::value
+                                           && !__alloc_has_construct<A, T>::value)> {};
+
+// One group's worth of never-occupied metadata. Tables that haven't allocated yet point here, so a
+// lookup in an empty table is the usual one group scan with no special case. It's const, so anything
+// that writes to it by mistake faults.
+template <typename = void>
+struct __empty_group
+{
+        alignas(64) static const uint8_t bytes[64];
+};
+
+template <typename Dummy>
+const uint8_t __empty_group<Dummy>::bytes[64] = {};
+
+// Room for one group of metadata and its slots inside the table object itself.
+template <size_t Bytes, size_t Align, bool Inline>
+struct __inline_group
+{
+        alignas(Align) uint8_t inline_bytes_[Bytes];
+};
+
+template <size_t Bytes, size_t Align>
+struct __inline_group<Bytes, Align, false>
+{};
+
+// Metadata and slots live in one allocation, metadata first, then a 0x7f end-of-table byte padded
+// out to the slots' alignment, then the slots. Align is the alignment of the metadata table, which
+// is the group width of the table on top of us. Memory comes from Allocator
+// (rebound to bytes), and elements are built and torn down through it too.
+//
+// A capacity of 0 means don't allocate yet: mem_ points at __empty_group with a capacity of one
+// group, and the table on top allocates for real before its first insert. With Inline, a table of
+// exactly one group lives inside the object instead and never touches the heap.
+template<typename T, size_t Align = 16, typename Allocator = std::allocator<T>, bool Inline = false>
 struct hash_set_mem
+        : __inline_group<Align * (1 + sizeof(T)) + (Align > alignof(T) ? Align : alignof(T)),
+                         (Align > alignof(T) ? Align : alignof(T)), Inline>
 {
         size_t capacity_;
 
@@ -36,7 +368,8 @@ struct hash_set_mem
         //     bits 6:0 dictate empty, erased, or end of table
         //     0x00 == empty/never occupied
         //     0x01 == erased/tombstoned
-        //     0x7f == end of table (not used yet)
+        //     0x02 == occupied, but waiting to be moved by an in-place rehash
+        //     0x7f == end of table, the byte after the last group
         // if bit7 == 1:
         //     bits 6:0 are low 7 bits of hash
         struct meta {
@@ -77,6 +410,11 @@ struct hash_set_mem
                         return m_ == 0x7f;
                 }
 
+                bool is_pending() const
+                {
+                        return m_ == 0x02;
+                }
+
                 uint8_t get_hash() const
                 {
                         assert(is_occupied());
@@ -93,6 +431,21 @@ struct hash_set_mem
                         assert((hash & 0x80) == 0);
                         m_ = 0x80 | hash;
                 }
+
+                void make_never_occupied()
+                {
+                        m_ = 0x00;
+                }
+
+                void make_pending()
+                {
+                        m_ = 0x02;
+                }
+
+                void make_end()
+                {
+                        m_ = 0x7f;
+                }
         };
 
         static_assert(sizeof(meta) == 1, "expected meta to be 1 byte");
@@ -102,6 +455,36 @@ struct hash_set_mem
         //  x1 --> occupied
         //  1x --> ever occupied
 private:
+        using byte_alloc_t = typename std::allocator_traits<Allocator>::template rebind_alloc<uint8_t>;
+        using byte_traits = std::allocator_traits<byte_alloc_t>;
+        using value_alloc_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        using value_traits = std::allocator_traits<value_alloc_t>;
+
+public:
+        // Elements can be torn down without doing anything, and copied or moved with memcpy.
+        static constexpr bool trivial_destroy = std::is_trivially_destructible<T>::value
+                && __alloc_is_plain<value_alloc_t, T>::value;
+        static constexpr bool trivial_copy = std::is_trivially_copyable<T>::value
+                && __alloc_is_plain<value_alloc_t, T>::value;
+
+private:
+
+        // allocators only promise alignof(uint8_t), so ask for a bit extra and line it up ourselves
+        static constexpr size_t mem_align = Align > alignof(T) ? Align : alignof(T);
+
+public:
+        // Bytes between the metadata and the slots. The first is the end-of-table byte, and it's
+        // a whole group's worth (at least) so the slots stay aligned.
+        static constexpr size_t end_pad = mem_align;
+
+        static size_t alloc_size_for(size_t cap)
+        {
+                return cap * (sizeof(meta) + sizeof(T)) + end_pad;
+        }
+
+private:
+        byte_alloc_t alloc_;
+        uint8_t * raw_;
         void * mem_;
 
         // XXX: these two functions depend on the child class only using capacities that are
@@ -110,10 +493,8 @@ private:
         {
                 assert(capacity_ % alignof(T) == 0);
 
-                std::ptrdiff_t off = capacity_ * sizeof(meta);
+                std::ptrdiff_t off = capacity_ * sizeof(meta) + end_pad;
 
-                // TODO: support weirdly alligned types? If alignof(T) > malloc alignment, we
-                // don't work at all.
                 assert((reinterpret_cast<std::ptrdiff_t>(mem_) + off) % alignof(T) == 0);
 
                 return off;
@@ -123,7 +504,7 @@ private:
         {
                 assert(capacity_ % alignof(T) == 0);
 
-                return capacity_ * (sizeof(meta) + sizeof(T));
+                return alloc_size_for(capacity_);
         }
 
 public:
@@ -155,457 +536,2806 @@ public:
                                                   + data_offset());
         }
 
-        // XXX: don't malloc
-        hash_set_mem(size_t cap)
-                : capacity_{cap},
-                  mem_{malloc(alloc_size())}
+        hash_set_mem(size_t cap, const Allocator& alloc = Allocator())
+                : capacity_{cap ? cap : Align},
+                  alloc_(alloc),
+                  raw_{nullptr}
         {
-                assert(mem_);
-                memset(get_meta(), 0, capacity_);
+                static_assert(Align <= sizeof(__empty_group<>::bytes), "group too wide");
+                assert(capacity_ % Align == 0);
+
+                if (Inline && capacity_ == Align) {
+                        mem_ = inline_mem();
+                        clear_meta();
+                } else if (cap == 0) {
+                        mem_ = const_cast<uint8_t *>(__empty_group<>::bytes);
+                } else {
+                        allocate();
+                }
         }
 
-        ~hash_set_mem()
+        // swap out the __empty_group for a real buffer of capacity cap
+        void allocate_sentinel(size_t cap)
         {
-                meta * mvec = get_meta();
-                T * dvec = get_data();
-                for (size_t i = 0; i < capacity_; ++i)
-                        if (mvec[i].is_occupied())
-                                dvec[i].~T();
+                assert(is_empty_sentinel());
+                capacity_ = cap;
+                allocate();
+        }
 
-                // XXX: exception safety if dtor throws
-                free(mem_);
+        // still pointing at __empty_group, nothing to free and nothing may be written
+        bool is_empty_sentinel() const
+        {
+                return mem_ == __empty_group<>::bytes;
         }
 
-        void swap(hash_set_mem & other)
+        bool is_inline() const
         {
-                std::swap(capacity_, other.capacity_);
-                std::swap(mem_, other.mem_);
+                return Inline && mem_ == inline_mem();
         }
 
-        hash_set_mem(const hash_set_mem& ) = delete;
-        hash_set_mem(hash_set_mem&&) = delete;
-        hash_set_mem& operator=(const hash_set_mem&) = delete;
-        hash_set_mem& operator=(hash_set_mem&&) = delete;
-};
+        // Point at a buffer of capacity cap that someone else owns, like a mapped file. It never
+        // gets freed or written to from here, so only const access is allowed after this.
+        void adopt_external(const void * mem, size_t cap)
+        {
+                static_assert(trivial_destroy, "can't tear down elements in someone else's buffer");
+                assert(is_empty_sentinel());
+                assert(reinterpret_cast<uintptr_t>(mem) % mem_align == 0);
+                capacity_ = cap;
+                mem_ = const_cast<void *>(mem);
+                raw_ = nullptr;
+        }
 
-template <typename T>
-void swap(hash_set_mem<T> & lhs, hash_set_mem<T> & rhs)
-{
-        lhs.swap(rhs);
-}
+        // metadata and slots are one block of this many bytes starting at __get_mem()
+        size_t mem_size() const
+        {
+                return alloc_size();
+        }
 
+        static constexpr size_t alignment = mem_align;
 
-template<typename T>
-class hash_set : hash_set_mem<T>
-{
-private:
-        using base_t = hash_set_mem<T>;
+        ~hash_set_mem()
+        {
+                if (is_empty_sentinel()) {
+                        return;
+                }
 
-        using meta = typename base_t::meta;
-        
+                if (!trivial_destroy) {
+                        meta * mvec = get_meta();
+                        T * dvec = get_data();
+                        for (size_t i = 0; i < capacity_; ++i)
+                                if (mvec[i].is_occupied())
+                                        destroy(dvec + i);
+                }
 
-        size_t size_;
-        size_t tombstones_;
+                // XXX: exception safety if dtor throws
+                if (raw_) {
+                        byte_traits::deallocate(alloc_, raw_, alloc_size() + mem_align - 1);
+                }
+        }
 
-        size_t sanitize_capacity(size_t cap)
+        template <typename... Ts>
+        void construct(T * p, Ts&& ... args)
         {
-                if (cap < 16) {
-                        return 16;
-                } if (__builtin_popcount(cap) == 1) {
-                        return cap;
-                } else {
-                        constexpr int size_t_bits = sizeof(size_t) * 8;
-
-                        // xxx: assumes size_t == unsigned long
-                        return static_cast<size_t>(1)
-                                << (size_t_bits - __builtin_clzl(cap));
-                }
+                value_alloc_t a(alloc_);
+                value_traits::construct(a, p, std::forward<Ts>(args)...);
         }
 
-public:
+        void destroy(T * p)
+        {
+                value_alloc_t a(alloc_);
+                value_traits::destroy(a, p);
+        }
 
-        hash_set(size_t capacity)
-                : base_t(sanitize_capacity(capacity)), size_(0), tombstones_(0)
-        {}
-        
-        hash_set() : hash_set(16)
-        {}
+        Allocator get_allocator() const
+        {
+                return Allocator(alloc_);
+        }
 
-        template <bool is_const>
-        class iterator_impl;
+        // Copy metadata and slots wholesale from a buffer of the same capacity. Whatever was here
+        // gets overwritten without being destroyed, which is fine because this is only for
+        // trivial_copy.
+        void copy_bytes(const hash_set_mem & other)
+        {
+                static_assert(trivial_copy, "copy_bytes needs trivially copyable elements");
+                assert(capacity_ == other.capacity_);
+                assert(!is_empty_sentinel() && !other.is_empty_sentinel());
+                memcpy(mem_, other.mem_, alloc_size());
+        }
 
-        using iterator = iterator_impl<false>;
-        using const_iterator = iterator_impl<true>;
-        
-        // xxx: make this iterator smaller? currently 32 bytes...
-        template <bool is_const> 
-        class iterator_impl {
-                using meta_ptr_t = typename std::conditional<is_const, const meta *, meta *>::type;
-        public:
-                using iterator_category = std::bidirectional_iterator_tag;
-                using value_type = typename std::conditional<is_const, const T, T>::type;
-                using difference_type = std::ptrdiff_t;
-                using reference = typename std::conditional<is_const, const T&, T&>::type;
-                using pointer = value_type *;
-                
-                // allow construction from non-const to const
-                iterator_impl(const iterator& rhs)
-                        : capacity(rhs.capacity),
-                          meta_start(rhs.meta_start),
-                          data_start(rhs.data_start),
-                          offset(rhs.offset)
-                {}
-                
-                bool operator==(const iterator_impl& rhs)
-                {
-                        // this is an extra comparison, but avoids undefined behavior from
-                        // comparing across containers 
-                        return meta_start == rhs.meta_start
-                                && offset == rhs.offset;
-                }
+        // Swapping only exchanges allocators if propagate_on_container_swap says to, and if it
+        // doesn't they have to be equal, like for any other container.
+        void swap(hash_set_mem & other)
+        {
+                constexpr bool pocs = byte_traits::propagate_on_container_swap::value;
+                assert(pocs || alloc_ == other.alloc_);
+                swap_storage(other, pocs);
+        }
 
-                bool operator!=(const iterator_impl& rhs)
-                {
-                        return !(*this == rhs);
+        // Trade buffers, and allocators too if with_alloc. Without, the two allocators have to be
+        // equal. Each buffer always ends up with the allocator that allocated it.
+        void swap_storage(hash_set_mem & other, bool with_alloc)
+        {
+                using std::swap;
+                if (is_inline()) {
+                        swap_inline(other, with_alloc);
+                        return;
+                } else if (other.is_inline()) {
+                        other.swap_inline(*this, with_alloc);
+                        return;
                 }
 
-                iterator_impl& operator++()
-                {
-                        assert(offset != capacity);
-                        
-                        for (;;) {
-                                ++offset;
-
-                                if (offset == capacity || meta_start[offset].is_occupied()) {
-                                        break;
-                                }
-                        }
-                        return *this;
+                std::swap(capacity_, other.capacity_);
+                if (with_alloc) {
+                        swap(alloc_, other.alloc_);
                 }
+                std::swap(raw_, other.raw_);
+                std::swap(mem_, other.mem_);
+        }
 
-                iterator_impl& operator--()
-                {
-                        assert(offset != 0);
-
-                        do {
-                                --offset;
-                                if (meta_start[offset].is_occupied()) {
-                                        return *this;
-                                }
-                        } while (offset != 0);
+        bool same_allocator(const hash_set_mem & other) const
+        {
+                return alloc_ == other.alloc_;
+        }
 
-                        return *this;
-                }
-                
-                reference operator*()
-                {
-                        return data_start[offset];
-                }
+private:
+        static constexpr size_t inline_size = Align * (1 + sizeof(T)) + end_pad;
 
-        private:
-                friend class hash_set;
-                
-                // these 3 fields should all be const, but operator= may need to change them if
-                // we assign from one container's iterator to another...
-                size_t capacity = 0;
-                meta_ptr_t meta_start = nullptr;
-                pointer data_start = nullptr;
-                
-                size_t offset = 0;
+        void allocate()
+        {
+                raw_ = &*byte_traits::allocate(alloc_, alloc_size() + mem_align - 1);
+                assert(raw_);
 
-                iterator_impl(size_t cap, meta_ptr_t meta, pointer data, size_t off)
-                        : capacity{cap}, meta_start{meta}, data_start{data}, offset{off}
-                {}
-        };
+                const uintptr_t p = reinterpret_cast<uintptr_t>(raw_);
+                mem_ = reinterpret_cast<void *>((p + mem_align - 1) & ~uintptr_t{mem_align - 1});
+                clear_meta();
+        }
 
-private:
-        size_t __find_first_occupied() const
+        // everything never occupied, and the end byte after it
+        void clear_meta()
         {
-                assert(size_ > 0);
-
-                const meta * mvec = this->get_meta();
-                __m128i mask = _mm_set1_epi8(0x80);
-                for (size_t i = 0; i < this->capacity(); i += 16) {
-                        const __m128i * mem = reinterpret_cast<const __m128i *>(mvec + i);
-
-                        __m128i group = _mm_load_si128(mem);
-                        __m128i masked = _mm_and_si128(group, mask);
-                        
-                        int bitmap = _mm_movemask_epi8(_mm_cmpeq_epi8(mask, masked));
-                        if (bitmap != 0) {
-                                return i + (__builtin_ffs(bitmap) - 1);
-                        }
-                }
+                memset(static_cast<void *>(get_meta()), 0, capacity_ + end_pad);
+                get_meta()[capacity_].make_end();
+        }
 
-                // we walked the whole damn table, but found nothing, even though size_ != 0. Bad.
-                assert(!"corrupted table");
-                __builtin_unreachable();
+        void * inline_mem()
+        {
+                return inline_mem(std::integral_constant<bool, Inline>{});
         }
 
-        iterator iterator_at(size_t i)
+        const void * inline_mem() const
         {
-                return iterator{this->capacity_, this->get_meta(), this->get_data(), i};
+                return const_cast<hash_set_mem *>(this)->inline_mem();
         }
 
-        const_iterator iterator_at(size_t i) const
+        void * inline_mem(std::true_type)
         {
-                return const_iterator{this->capacity_, this->get_meta(), this->get_data(), i};
+                return this->inline_bytes_;
         }
 
-public:
-        iterator end()
+        void * inline_mem(std::false_type)
         {
-                return iterator_at(this->capacity_);
+                return nullptr;
         }
-        
-        iterator begin()
+
+        // Move the occupied slots of our inline group into other's inline group, which must be
+        // free, and point other at it.
+        void move_inline_to(hash_set_mem & other)
+        {
+                void * dst = other.inline_mem();
+                meta * mvec = get_meta();
+                T * dvec = get_data();
+
+                if (trivial_copy) {
+                        memcpy(dst, mem_, inline_size);
+                } else {
+                        T * odvec = reinterpret_cast<T *>(static_cast<uint8_t *>(dst)
+                                                          + Align + end_pad);
+                        for (size_t i = 0; i < Align; ++i) {
+                                if (mvec[i].is_occupied()) {
+                                        other.construct(odvec + i, std::move(dvec[i]));
+                                        destroy(dvec + i);
+                                }
+                        }
+                        memcpy(dst, mvec, Align + end_pad);
+                }
+                other.mem_ = dst;
+                other.raw_ = nullptr;
+                other.capacity_ = Align;
+        }
+
+        // Swap when we're inline: the elements have to actually move, the buffer can't. Each
+        // move constructs with the allocator the element ends up under and destroys with the one
+        // that built it, so the allocators get handed over partway through.
+        void swap_inline(hash_set_mem & other, bool with_alloc)
+        {
+                assert(is_inline());
+                using std::swap;
+
+                if (!other.is_inline()) {
+                        void * mem = other.mem_;
+                        uint8_t * raw = other.raw_;
+                        size_t cap = other.capacity_;
+                        byte_alloc_t spare(alloc_);
+                        if (with_alloc) {
+                                swap(spare, other.alloc_);
+                        }
+                        move_inline_to(other);
+                        if (with_alloc) {
+                                swap(alloc_, spare);
+                        }
+                        mem_ = mem;
+                        raw_ = raw;
+                        capacity_ = cap;
+                } else if (trivial_copy) {
+                        uint8_t * mine = static_cast<uint8_t *>(inline_mem());
+                        std::swap_ranges(mine, mine + inline_size,
+                                         static_cast<uint8_t *>(other.inline_mem()));
+                        if (with_alloc) {
+                                swap(alloc_, other.alloc_);
+                        }
+                } else {
+                        // both inline: go through a third table
+                        hash_set_mem tmp{Align, Allocator(alloc_)};
+                        move_inline_to(tmp);
+                        byte_alloc_t spare(other.alloc_);
+                        if (with_alloc) {
+                                swap(alloc_, spare);
+                        }
+                        other.move_inline_to(*this);
+                        if (with_alloc) {
+                                swap(other.alloc_, spare);
+                        }
+                        tmp.move_inline_to(other);
+                        tmp.clear_meta();
+                }
+        }
+
+public:
+        hash_set_mem(const hash_set_mem& ) = delete;
+        hash_set_mem(hash_set_mem&&) = delete;
+        hash_set_mem& operator=(const hash_set_mem&) = delete;
+        hash_set_mem& operator=(hash_set_mem&&) = delete;
+};
+
+template <typename T, size_t Align, typename Allocator>
+void swap(hash_set_mem<T, Align, Allocator> & lhs, hash_set_mem<T, Align, Allocator> & rhs)
+{
+        lhs.swap(rhs);
+}
+
+#ifdef __SIZEOF_INT128__
+// __extension__ keeps -pedantic quiet about the non-standard type, once, here
+__extension__ typedef unsigned __int128 __u128;
+#endif
+
+// 64x64 -> 128 bit multiply, folded back down to 64 bits. Every input bit affects the middle of the
+// product, and the fold spreads that over the whole word.
+inline uint64_t __mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+        const __u128 m = static_cast<__u128>(a) * b;
+        return static_cast<uint64_t>(m) ^ static_cast<uint64_t>(m >> 64);
+#else
+        // no 128 bit multiply: murmur3's finalizer on the two words instead
+        uint64_t h = a ^ (b * 0xc6a4a7935bd1e995ull);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+#endif
+}
+
+// Post-mix applied to every user hash. libstdc++'s std::hash for integers is the identity, so
+// without this sequential keys share index bits with their neighbours and the low 7 bits that go
+// into the metadata are just the raw low bits of the key.
+inline size_t __hash_mix(size_t h)
+{
+        return static_cast<size_t>(__mum(h, 0x9e3779b97f4a7c15ull));
+}
+
+// Map x onto [0, n) with the high half of x * n instead of a divide. Uses the top bits of x, so x
+// needs to be well mixed there.
+inline size_t __fastrange(uint64_t x, size_t n)
+{
+#ifdef __SIZEOF_INT128__
+        return static_cast<size_t>((static_cast<__u128>(x) * n) >> 64);
+#else
+        // only right for n < 2^32, which is plenty of groups
+        return static_cast<size_t>(((x >> 32) * n) >> 32);
+#endif
+}
+
+// wyhash flavored hash of a run of bytes: 16 bytes per multiply, and the tail gets zero padded.
+inline size_t hash_bytes(const void * p, size_t len, uint64_t seed = 0)
+{
+        const uint64_t k0 = 0xa0761d6478bd642full;
+        const uint64_t k1 = 0xe7037ed1a0b428dbull;
+        const uint8_t * bytes = static_cast<const uint8_t *>(p);
+        uint64_t h = seed ^ k0;
+
+        size_t n = len;
+        for (; n >= 16; n -= 16, bytes += 16) {
+                h = __mum(__swar_load(bytes) ^ k1, __swar_load(bytes + 8) ^ h);
+        }
+
+        if (n > 0) {
+                uint8_t tail[16] = {};
+                memcpy(tail, bytes, n);
+                h = __mum(__swar_load(tail) ^ k1, __swar_load(tail + 8) ^ h);
+        }
+
+        return static_cast<size_t>(__mum(h ^ k1, len ^ k0));
+}
+
+// Types whose values are fully described by their bytes: no padding, and == means the bytes are
+// equal. Specialize this for your own structs to get hash_bytes from ht_hash.
+template <typename T>
+struct is_bytewise_hashable : std::integral_constant<bool, std::is_integral<T>::value
+                                                           || std::is_enum<T>::value
+                                                           || std::is_pointer<T>::value>
+{};
+
+template <typename T, size_t N>
+struct is_bytewise_hashable<std::array<T, N>> : is_bytewise_hashable<T>
+{};
+
+template <typename T, size_t N>
+struct is_bytewise_hashable<T[N]> : is_bytewise_hashable<T>
+{};
+
+template <typename T, bool = is_bytewise_hashable<T>::value && !std::is_scalar<T>::value>
+struct __ht_hash_impl : std::hash<T>
+{};
+
+template <typename T>
+struct __ht_hash_impl<T, true>
+{
+        size_t operator()(const T& v) const
+        {
+                return hash_bytes(&v, sizeof(v));
+        }
+};
+
+// Default hasher: one pass of hash_bytes over contiguous keys like std::array<uint32_t, N>, and
+// std::hash for everything else. Single scalars are left to std::hash, since do_hash mixes them
+// anyway.
+template <typename T>
+struct ht_hash : __ht_hash_impl<T>
+{};
+
+// Strings hash as string_view, so anything that converts to one can be looked up without building a
+// string first. Pair with std::equal_to<> to turn on transparent lookups.
+template <>
+struct ht_hash<std::string>
+{
+        using is_transparent = void;
+
+        size_t operator()(std::string_view s) const
+        {
+                return std::hash<std::string_view>{}(s);
+        }
+};
+
+// Hash and KeyEqual both opt in to being called with things other than key_type
+template <typename Hash, typename KeyEqual, typename = void>
+struct __is_transparent : std::false_type {};
+
+template <typename Hash, typename KeyEqual>
+struct __is_transparent<Hash, KeyEqual, std::void_t<typename Hash::is_transparent,
+                                                    typename KeyEqual::is_transparent>>
+        : std::true_type {};
+
+// Where elements live. flat: right in the slot array. node: the slot array holds pointers and each
+// element gets its own allocation, so elements never move (references survive rehashes) and a
+// resize shuffles pointers no matter how big T is. automatic: nodes for big elements.
+enum class slot_storage : uint8_t {
+        automatic,
+        flat,
+        node,
+};
+
+// xxx: the cutoff is a guess. Past a couple of cache lines, moving elements on resize and leaving
+// ~30% of the slot array empty hurt more than the extra pointer chase on lookups.
+template <typename T, slot_storage Storage>
+struct __uses_nodes
+        : std::integral_constant<bool, Storage == slot_storage::node
+                                       || (Storage == slot_storage::automatic && sizeof(T) > 128)>
+{};
+
+// What goes in a slot, and how to get from a slot to the element.
+template <typename T, bool Nodes>
+struct __slot_policy
+{
+        using slot_type = T;
+        using element_type = T;
+        static constexpr bool nodes = false;
+        static constexpr bool stores_hash = false;
+
+        static size_t hash(const slot_type&)
+        {
+                return 0;
+        }
+
+        static T& element(slot_type& s)
+        {
+                return s;
+        }
+
+        static const T& element(const slot_type& s)
+        {
+                return s;
+        }
+};
+
+template <typename T>
+struct __slot_policy<T, true>
+{
+        using slot_type = T *;
+        using element_type = T;
+        static constexpr bool nodes = true;
+        static constexpr bool stores_hash = false;
+
+        static size_t hash(const slot_type&)
+        {
+                return 0;
+        }
+
+        static T& element(slot_type& s)
+        {
+                return *s;
+        }
+
+        static const T& element(const slot_type& s)
+        {
+                return *s;
+        }
+};
+
+// A slot from some other policy with the element's full hash in front of it. Costs a word per
+// slot, but resizing never calls the user's hash again and a lookup only compares keys whose whole
+// hash matched, which is worth it when hashing or comparing keys is expensive.
+template <typename S>
+struct __hashed_slot
+{
+        size_t hash;
+        S slot;
+
+        template <typename... Ts>
+        __hashed_slot(size_t h, Ts&& ... args)
+                : hash(h), slot(std::forward<Ts>(args)...)
+        {}
+};
+
+template <typename Policy>
+struct __hashed_slot_policy
+{
+        using slot_type = __hashed_slot<typename Policy::slot_type>;
+        using element_type = typename Policy::element_type;
+        static constexpr bool nodes = Policy::nodes;
+        static constexpr bool stores_hash = true;
+
+        static size_t hash(const slot_type& s)
+        {
+                return s.hash;
+        }
+
+        static element_type& element(slot_type& s)
+        {
+                return Policy::element(s.slot);
+        }
+
+        static const element_type& element(const slot_type& s)
+        {
+                return Policy::element(s.slot);
+        }
+};
+
+template <typename T, slot_storage Storage, bool StoreHash>
+using __slot_policy_for = typename std::conditional<
+        StoreHash,
+        __hashed_slot_policy<__slot_policy<T, __uses_nodes<T, Storage>::value>>,
+        __slot_policy<T, __uses_nodes<T, Storage>::value>>::type;
+
+// How a lookup moves on from a group with no empty slot. Both kinds step through group aligned
+// offsets and see every group once in the first capacity / W steps.
+//
+// linear_probing goes to the next group. The next group is usually the next cache line, but keys
+// that start near each other pile up into one long run, which gets worse with skewed hashes and
+// lots of tombstones.
+//
+// triangular_probing steps 1, 2, 3, ... groups, so runs from neighbouring starts split up after
+// a step or two, at the price of a cache miss per step past the first. Only with pow2_sizing,
+// since with any other number of groups the steps don't reach all of them.
+struct linear_probing {
+        static constexpr uint16_t id = 0;
+};
+
+struct triangular_probing {
+        static constexpr uint16_t id = 1;
+};
+
+// How capacities are picked.
+//
+// pow2_sizing keeps them powers of two and doubles on growth, so a probe's first group is a mask
+// of the hash and wrapping around is another mask.
+//
+// compact_sizing allows any multiple of the group width and grows by 1.5x, so the buffer tracks
+// the element count much closer: 9M elements take about 13M slots instead of 16M, and a table
+// never sits at less than half its resize threshold after growing. The first group comes from
+// __fastrange and linear probes wrap with a compare.
+struct pow2_sizing {
+        static constexpr uint16_t id = 0;
+};
+
+struct compact_sizing {
+        static constexpr uint16_t id = 1;
+};
+
+// A probe in progress: offset() is the first slot of the group to look at, and index() is how
+// many groups came before it. start has to be group aligned and less than cap.
+template <typename Probe, size_t W, bool Pow2>
+class __probe_seq
+{
+public:
+        __probe_seq(size_t start, size_t cap)
+                : offset_{start},
+                  cap_{cap}
+        {
+                assert(start % W == 0 && start < cap);
+        }
+
+        size_t offset() const
+        {
+                return offset_;
+        }
+
+        size_t index() const
+        {
+                return index_;
+        }
+
+        void next()
+        {
+                ++index_;
+                if (Pow2) {
+                        offset_ = (offset_ + (__triangular ? index_ * W : W)) & (cap_ - 1);
+                } else {
+                        offset_ += W;
+                        if (offset_ == cap_) {
+                                offset_ = 0;
+                        }
+                }
+        }
+
+private:
+        static constexpr bool __triangular = std::is_same<Probe, triangular_probing>::value;
+        static_assert(__triangular || std::is_same<Probe, linear_probing>::value,
+                      "unknown probing policy");
+        static_assert(Pow2 || !__triangular, "triangular_probing needs pow2_sizing");
+
+        size_t offset_;
+        size_t index_ = 0;
+        size_t cap_;
+};
+
+// Traits tell hash_table how to get the key out of a stored value. For a set the value is the
+// key, for a map it's the first half of the pair. They also carry the user's hash, equality and
+// allocator types along, and the slot policy.
+template <typename T, typename Hash, typename KeyEqual, typename Allocator, size_t GroupWidth,
+          slot_storage Storage, bool InlineGroup, bool StoreHash, typename Probe, typename Sizing>
+struct __set_traits : __slot_policy_for<T, Storage, StoreHash>
+{
+        using key_type = T;
+        using value_type = T;
+        using hasher = Hash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+        using probing = Probe;
+        using sizing = Sizing;
+
+        static constexpr size_t group_width = GroupWidth;
+        static constexpr bool inline_group = InlineGroup;
+
+        static const key_type& key(const value_type& v)
+        {
+                return v;
+        }
+};
+
+template <typename K, typename V, typename Hash, typename KeyEqual, typename Allocator,
+          size_t GroupWidth, slot_storage Storage, bool InlineGroup, bool StoreHash,
+          typename Probe, typename Sizing>
+struct __map_traits : __slot_policy_for<std::pair<const K, V>, Storage, StoreHash>
+{
+        using key_type = K;
+        using value_type = std::pair<const K, V>;
+        using hasher = Hash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+        using probing = Probe;
+        using sizing = Sizing;
+
+        static constexpr size_t group_width = GroupWidth;
+        static constexpr bool inline_group = InlineGroup;
+
+        static const key_type& key(const value_type& v)
+        {
+                return v.first;
+        }
+};
+
+// On-disk snapshot of a hash_table (see hash_table::save and mapped_hash_set in ht_mmap.h): this
+// header, then the table's metadata, end byte and slots exactly as they sit in memory. The block
+// starts 64 bytes in, so a mapping of the file lines it up for any group width. Nothing is byte
+// swapped, and the hash function isn't recorded, so a snapshot is only good for the same Hash on
+// the same kind of machine.
+struct __ht_file_header {
+        char magic[8];
+        uint32_t version;
+        uint16_t group_width;
+        uint16_t probing;       // Probe::id | Sizing::id << 8, since they decide where things are
+        uint64_t slot_size;
+        uint64_t capacity;      // 0 for a table that never allocated, and then there's no block
+        uint64_t size;
+        uint64_t tombstones;
+        uint64_t seed;          // do_hash's seed, which the slot positions depend on
+        uint64_t checksum;      // hash_bytes of the block
+};
+
+static_assert(sizeof(__ht_file_header) == 64, "block has to start 64 bytes in");
+
+static constexpr char __ht_file_magic[8] = {'h', 't', 's', 'n', 'a', 'p', '\0', '\0'};
+static constexpr uint32_t __ht_file_version = 3;
+
+template<typename Traits>
+class hash_table : hash_set_mem<typename Traits::slot_type, Traits::group_width,
+                                typename Traits::allocator_type, Traits::inline_group>
+{
+public:
+        using key_type = typename Traits::key_type;
+        using value_type = typename Traits::value_type;
+        using hasher = typename Traits::hasher;
+        using key_equal = typename Traits::key_equal;
+        using allocator_type = typename Traits::allocator_type;
+
+private:
+        using T = value_type;
+        using slot_type = typename Traits::slot_type;
+        using base_t = hash_set_mem<slot_type, Traits::group_width, allocator_type,
+                                    Traits::inline_group>;
+        static constexpr bool __nodes = Traits::nodes;
+        static constexpr bool __stores_hash = Traits::stores_hash;
+
+public:
+        static constexpr bool __uses_node_storage = __nodes;
+        static constexpr size_t __group_width = Traits::group_width;
+        static constexpr size_t __slot_size = sizeof(slot_type);
+        using __probing = typename Traits::probing;
+        // both decide where elements sit, so a snapshot has to match on both
+        static constexpr uint16_t __probing_id = __probing::id | Traits::sizing::id << 8;
+
+        // whether a table of this kind can have capacity cap (0 == never allocated). Safe to ask
+        // about any cap, even one whose __mem_size_for would overflow.
+        static bool __valid_capacity(size_t cap)
+        {
+                constexpr size_t max = (SIZE_MAX - 2 * base_t::end_pad) / (1 + sizeof(slot_type));
+                return cap == 0 || (cap >= W && cap <= max && sanitize_capacity(cap) == cap);
+        }
+
+        // bytes in the block save() writes for a table of capacity cap
+        static size_t __mem_size_for(size_t cap)
+        {
+                return cap == 0 ? 0 : base_t::alloc_size_for(cap);
+        }
+
+private:
+        using node_alloc_t = typename std::allocator_traits<allocator_type>::template rebind_alloc<T>;
+        using node_traits = std::allocator_traits<node_alloc_t>;
+        using group = __group<Traits::group_width>;
+        static constexpr bool __pow2 = std::is_same<typename Traits::sizing, pow2_sizing>::value;
+        static_assert(__pow2 || std::is_same<typename Traits::sizing, compact_sizing>::value,
+                      "unknown sizing policy");
+        using probe_seq = __probe_seq<typename Traits::probing, Traits::group_width, __pow2>;
+        static constexpr size_t W = Traits::group_width;
+        using alloc_traits = std::allocator_traits<allocator_type>;
+        // moving a table only swaps pointers, unless its elements sit in the inline group
+        static constexpr bool __nothrow_slot_move =
+                !Traits::inline_group || std::is_nothrow_move_constructible<slot_type>::value;
+        // the move constructor copies rhs's hasher and key_equal
+        static constexpr bool __nothrow_move = __nothrow_slot_move
+                && std::is_nothrow_copy_constructible<hasher>::value
+                && std::is_nothrow_copy_constructible<key_equal>::value;
+        // move assignment swaps them instead, unless the allocators don't match and won't move,
+        // and the elements have to come over one by one
+        static constexpr bool __nothrow_move_assign = __nothrow_slot_move
+                && std::is_nothrow_swappable<hasher>::value
+                && std::is_nothrow_swappable<key_equal>::value
+                && (alloc_traits::propagate_on_container_move_assignment::value
+                    || alloc_traits::is_always_equal::value);
+
+        using meta = typename base_t::meta;
+
+        template <typename, typename, typename, typename, typename, size_t, slot_storage, bool,
+                  bool, typename, typename>
+        friend class hash_map;
+
+        // xxx: these take up space even when they're empty, which they almost always are
+        hasher hash_;
+        key_equal eq_;
+        size_t size_;
+        size_t tombstones_;
+        // mixed into every hash. Copies keep it so their elements stay where they are, and so does
+        // a resize when the slots store hashes, since those were computed with it
+        size_t seed_;
+
+        static size_t sanitize_capacity(size_t cap)
+        {
+                if (cap < W) {
+                        return W;
+                } if (!__pow2) {
+                        // slots come right after the metadata, so stay a multiple of their
+                        // alignment too
+                        constexpr size_t align = base_t::alignment;
+                        return (cap + align - 1) / align * align;
+                } if ((cap & (cap - 1)) == 0) {
+                        return cap;
+                } else {
+                        constexpr int size_t_bits = sizeof(size_t) * 8;
+
+                        // xxx: assumes size_t == unsigned long
+                        return static_cast<size_t>(1)
+                                << (size_t_bits - __builtin_clzl(cap));
+                }
+        }
+
+public:
+
+        // A capacity of 0 doesn't allocate anything until the first insert
+        hash_table(size_t capacity, const hasher& hash = hasher(),
+                   const key_equal& eq = key_equal(), const allocator_type& alloc = allocator_type())
+                : base_t(capacity == 0 ? 0 : sanitize_capacity(capacity), alloc),
+                  hash_(hash), eq_(eq), size_(0),
+                  // an unallocated table claims to be full, so its first insert takes the resize
+                  // path and allocates there, instead of every insert checking
+                  tombstones_(this->is_empty_sentinel() ? this->capacity_ : 0),
+                  seed_(__make_seed())
+        {}
+        
+        hash_table() : hash_table(0)
+        {}
+
+        struct __external_tag {};
+
+        // Read-only table over a block laid out by save(), which the caller keeps alive. Only the
+        // const API may be used on it.
+        hash_table(__external_tag, const void * mem, const __ht_file_header& h,
+                   const hasher& hash = hasher(), const key_equal& eq = key_equal())
+                : hash_table(0, hash, eq)
+        {
+                if (h.capacity != 0) {
+                        this->adopt_external(mem, h.capacity);
+                        size_ = h.size;
+                        tombstones_ = h.tombstones;
+                        seed_ = h.seed;
+                }
+        }
+
+        explicit hash_table(const allocator_type& alloc)
+                : hash_table(0, hasher(), key_equal(), alloc)
+        {}
+
+        // Same capacity, same seed, so every element lands in the same slot it had in rhs
+        hash_table(const hash_table& rhs)
+                : hash_table(rhs, alloc_traits::select_on_container_copy_construction(
+                                          rhs.get_allocator()))
+        {}
+
+        hash_table(const hash_table& rhs, const allocator_type& alloc)
+                : base_t(rhs.is_empty_sentinel() ? 0 : rhs.capacity_, alloc),
+                  hash_(rhs.hash_), eq_(rhs.eq_), size_(rhs.size_), tombstones_(rhs.tombstones_),
+                  seed_(rhs.seed_)
+        {
+                if (!rhs.is_empty_sentinel()) {
+                        __copy_slots(rhs, std::integral_constant<bool, __bytewise_copy>{});
+                }
+        }
+
+        // leaves rhs empty, and with nothing allocated
+        hash_table(hash_table&& rhs) noexcept(__nothrow_move)
+                : hash_table(0, rhs.hash_, rhs.eq_, rhs.get_allocator())
+        {
+                swap(rhs);
+        }
+
+        hash_table& operator=(const hash_table& rhs)
+        {
+                if (this == &rhs) {
+                        return *this;
+                }
+
+                constexpr bool pocca = alloc_traits::propagate_on_container_copy_assignment::value;
+                if (__bytewise_copy && this->capacity_ == rhs.capacity_
+                    && !this->is_empty_sentinel() && !rhs.is_empty_sentinel()
+                    && (!pocca || this->same_allocator(rhs))) {
+                        // nothing to tear down, just write over our own buffer
+                        __copy_slots(rhs, std::integral_constant<bool, __bytewise_copy>{});
+                        hash_ = rhs.hash_;
+                        eq_ = rhs.eq_;
+                        size_ = rhs.size_;
+                        tombstones_ = rhs.tombstones_;
+                        seed_ = rhs.seed_;
+                } else {
+                        // we keep our own allocator unless it's supposed to follow rhs's
+                        hash_table tmp{rhs, pocca ? rhs.get_allocator() : get_allocator()};
+                        __swap(tmp, true);
+                }
+                return *this;
+        }
+
+        hash_table& operator=(hash_table&& rhs) noexcept(__nothrow_move_assign)
+        {
+                constexpr bool pocma = alloc_traits::propagate_on_container_move_assignment::value;
+                if (pocma || this->same_allocator(rhs)) {
+                        __swap(rhs, pocma);
+                } else {
+                        // rhs's buffer has to be freed by rhs's allocator, so only the elements
+                        // can come over
+                        hash_table tmp{0, rhs.hash_, rhs.eq_, get_allocator()};
+                        tmp.reserve(rhs.size_);
+                        rhs.__move_elements_to(tmp);
+                        hash_table{0, rhs.hash_, rhs.eq_, rhs.get_allocator()}.swap(rhs);
+                        swap(tmp);
+                }
+                return *this;
+        }
+
+        ~hash_table()
+        {
+                if (__nodes) {
+                        slot_type * dvec = this->get_data();
+                        const meta * mvec = this->get_meta();
+                        for (size_t i = 0; i < this->capacity_; i += W) {
+                                uint64_t bitmap = group::match_occupied(mvec + i);
+                                while (bitmap != 0) {
+                                        __free_node(dvec + i + __builtin_ctzll(bitmap),
+                                                    std::integral_constant<bool, __nodes>{});
+                                        bitmap &= bitmap - 1;
+                                }
+                        }
+                }
+                // hash_set_mem takes care of the slots themselves
+        }
+
+private:
+        // a copy can be a straight memcpy of the buffer. Not for nodes, those have to be copied
+        // one at a time
+        static constexpr bool __bytewise_copy = base_t::trivial_copy && !__nodes;
+
+        void __copy_slots(const hash_table& rhs, std::true_type)
+        {
+                this->copy_bytes(rhs);
+        }
+
+        // only mark a slot occupied once its element exists, so if a copy throws, our destructor
+        // cleans up exactly what got built
+        void __copy_slots(const hash_table& rhs, std::false_type)
+        {
+                meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+                const meta * rmvec = rhs.get_meta();
+                const slot_type * rdvec = rhs.get_data();
+
+                for (size_t i = 0; i < this->capacity_; i += W) {
+                        uint64_t bitmap = group::match_occupied(rmvec + i);
+                        while (bitmap != 0) {
+                                const size_t idx = i + __builtin_ctzll(bitmap);
+                                __construct_slot(dvec + idx, Traits::hash(rdvec[idx]),
+                                                 Traits::element(rdvec[idx]));
+                                mvec[idx] = rmvec[idx];
+                                bitmap &= bitmap - 1;
+                        }
+                }
+                // and now the tombstones
+                memcpy(static_cast<void *>(mvec), rmvec, this->capacity_);
+        }
+
+        // Build an element in slot s. With nodes, it goes in its own allocation first. hash only
+        // gets kept if the slots store hashes.
+        template <typename... Ts>
+        void __construct_slot(slot_type * s, size_t hash, Ts&& ... args)
+        {
+                __construct_slot(std::integral_constant<bool, __nodes>{}, s, hash,
+                                 std::forward<Ts>(args)...);
+        }
+
+        template <typename... Ts>
+        void __construct_slot(std::false_type, slot_type * s, size_t hash, Ts&& ... args)
+        {
+                __construct_raw_slot(std::integral_constant<bool, __stores_hash>{}, s, hash,
+                                     std::forward<Ts>(args)...);
+        }
+
+        template <typename... Ts>
+        void __construct_slot(std::true_type, slot_type * s, size_t hash, Ts&& ... args)
+        {
+                node_alloc_t a(this->get_allocator());
+                T * node = node_traits::allocate(a, 1);
+                try {
+                        node_traits::construct(a, &*node, std::forward<Ts>(args)...);
+                } catch (...) {
+                        node_traits::deallocate(a, node, 1);
+                        throw;
+                }
+                __construct_raw_slot(std::integral_constant<bool, __stores_hash>{}, s, hash,
+                                     &*node);
+        }
+
+        template <typename... Ts>
+        void __construct_raw_slot(std::false_type, slot_type * s, size_t, Ts&& ... args)
+        {
+                this->construct(s, std::forward<Ts>(args)...);
+        }
+
+        template <typename... Ts>
+        void __construct_raw_slot(std::true_type, slot_type * s, size_t hash, Ts&& ... args)
+        {
+                this->construct(s, hash, std::forward<Ts>(args)...);
+        }
+
+        void __destroy_slot(slot_type * s)
+        {
+                __free_node(s, std::integral_constant<bool, __nodes>{});
+                this->destroy(s);
+        }
+
+        void __free_node(slot_type *, std::false_type)
+        {}
+
+        void __free_node(slot_type * s, std::true_type)
+        {
+                node_alloc_t a(this->get_allocator());
+                T * node = &Traits::element(*s);
+                node_traits::destroy(a, node);
+                node_traits::deallocate(a, node, 1);
+        }
+
+        // Move the element in slot src here into slot dst of other, which the caller then hands to
+        // __occupy. The old slot is left destroyed but still marked occupied. With nodes only the
+        // pointer moves.
+        void __transfer_slot(slot_type * src, hash_table & other, slot_type * dst)
+        {
+                if (base_t::trivial_copy) {
+                        memcpy(static_cast<void *>(dst), src, sizeof(slot_type));
+                } else {
+                        other.construct(dst, std::move(*src));
+                        this->destroy(src);
+                }
+        }
+
+        static const key_type& __slot_key(const slot_type& s)
+        {
+                return Traits::key(Traits::element(s));
+        }
+
+        // Could slot idx hold a key with this hash? Without stored hashes we can't tell until we
+        // compare keys.
+        bool __hash_matches(size_t idx, size_t hash) const
+        {
+                return !__stores_hash || Traits::hash(this->get_data()[idx]) == hash;
+        }
+
+        // The element in s's hash as dst computes it. Free when it's stored and dst has our seed.
+        size_t __hash_for(const hash_table & dst, const slot_type& s) const
+        {
+                if (__stores_hash && dst.seed_ == seed_) {
+                        return Traits::hash(s);
+                }
+                return dst.do_hash(__slot_key(s));
+        }
+
+        T& __element(size_t idx)
+        {
+                return Traits::element(this->get_data()[idx]);
+        }
+
+        const T& __element(size_t idx) const
+        {
+                return Traits::element(this->get_data()[idx]);
+        }
+
+public:
+
+        using base_t::get_allocator;
+
+        // Smallest capacity that holds n elements without resizing. An insert resizes when the
+        // table is already more than 0.7 full, so the n-th insert needs (n - 1) / capacity <= 0.7.
+        static size_t __capacity_for(size_t n)
+        {
+                return sanitize_capacity(n == 0 ? 0 : ((n - 1) * 10 + 6) / 7);
+        }
+
+        hasher hash_function() const
+        {
+                return hash_;
+        }
+
+        key_equal key_eq() const
+        {
+                return eq_;
+        }
+
+        template <bool is_const>
+        class iterator_impl;
+
+        using iterator = iterator_impl<false>;
+        using const_iterator = iterator_impl<true>;
+        
+        // Just the slot's metadata byte and the slot itself. The 0x7f byte after the last group is
+        // what end() points at and where ++ stops, so nothing needs to know the capacity.
+        template <bool is_const> 
+        class iterator_impl {
+                using meta_ptr_t = typename std::conditional<is_const, const meta *, meta *>::type;
+                using slot_ptr_t = typename std::conditional<is_const, const slot_type *,
+                                                             slot_type *>::type;
+        public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using value_type = typename std::conditional<is_const, const T, T>::type;
+                using difference_type = std::ptrdiff_t;
+                using reference = typename std::conditional<is_const, const T&, T&>::type;
+                using pointer = value_type *;
+                
+                iterator_impl() = default;
+                iterator_impl(const iterator_impl&) = default;
+                iterator_impl& operator=(const iterator_impl&) = default;
+
+                // allow construction from non-const to const
+                template <bool was_const, typename = typename std::enable_if<is_const
+                                                                             && !was_const>::type>
+                iterator_impl(const iterator_impl<was_const>& rhs)
+                        : ctrl_(rhs.ctrl_),
+                          slot_(rhs.slot_)
+                {}
+                
+                bool operator==(const iterator_impl& rhs) const
+                {
+                        return ctrl_ == rhs.ctrl_;
+                }
+
+                bool operator!=(const iterator_impl& rhs) const
+                {
+                        return !(*this == rhs);
+                }
+
+                iterator_impl& operator++()
+                {
+                        assert(!ctrl_->is_end());
+                        ++ctrl_;
+                        ++slot_;
+                        // in a full table the next slot usually has something, and a byte
+                        // compare is cheaper than a group scan
+                        if (!ctrl_->is_occupied()) {
+                                skip_unoccupied();
+                        }
+                        return *this;
+                }
+
+                // can't go back past begin(), so there's always an occupied slot to stop at
+                iterator_impl& operator--()
+                {
+                        do {
+                                --ctrl_;
+                                --slot_;
+                        } while (!ctrl_->is_occupied());
+                        return *this;
+                }
+                
+                reference operator*() const
+                {
+                        return Traits::element(*slot_);
+                }
+
+                pointer operator->() const
+                {
+                        return &Traits::element(*slot_);
+                }
+
+        private:
+                friend class hash_table;
+                template <bool>
+                friend class iterator_impl;
+                
+                meta_ptr_t ctrl_ = nullptr;
+                slot_ptr_t slot_ = nullptr;
+
+                iterator_impl(meta_ptr_t ctrl, slot_ptr_t slot)
+                        : ctrl_{ctrl}, slot_{slot}
+                {}
+
+                // Forward to the next occupied slot (or the end byte) a group at a time. Groups are
+                // aligned to W, so scan the one we're in and shift off the slots already behind us.
+                void skip_unoccupied()
+                {
+                        while (!ctrl_->is_end()) {
+                                const size_t behind = reinterpret_cast<uintptr_t>(ctrl_) & (W - 1);
+                                const uint64_t bitmap = group::match_occupied(ctrl_ - behind)
+                                        >> behind;
+                                if (bitmap != 0) {
+                                        const size_t n = __builtin_ctzll(bitmap);
+                                        ctrl_ += n;
+                                        slot_ += n;
+                                        return;
+                                }
+                                ctrl_ += W - behind;
+                                slot_ += W - behind;
+                        }
+                }
+        };
+
+private:
+        size_t __find_first_occupied() const
+        {
+                assert(size_ > 0);
+
+                const meta * mvec = this->get_meta();
+                for (size_t i = 0; i < this->capacity(); i += W) {
+                        uint64_t bitmap = group::match_occupied(mvec + i);
+                        if (bitmap != 0) {
+                                return i + __builtin_ctzll(bitmap);
+                        }
+                }
+
+                // we walked the whole damn table, but found nothing, even though size_ != 0. Bad.
+                assert(!"corrupted table");
+                __builtin_unreachable();
+        }
+
+        iterator iterator_at(size_t i)
+        {
+                return iterator{this->get_meta() + i, this->get_data() + i};
+        }
+
+        const_iterator iterator_at(size_t i) const
+        {
+                return const_iterator{this->get_meta() + i, this->get_data() + i};
+        }
+
+        // slot index an iterator into this table points at
+        size_t __index_of(const_iterator it) const
+        {
+                return it.ctrl_ - this->get_meta();
+        }
+
+public:
+        iterator end()
+        {
+                return iterator_at(this->capacity_);
+        }
+        
+        iterator begin()
         {
                 if (size() == 0) {
                         return end();
                 }
 
-                return iterator_at(__find_first_occupied());
+                return iterator_at(__find_first_occupied());
+        }
+
+        const_iterator end() const
+        {
+                return iterator_at(this->capacity_);
+        }
+
+        // xxx: can we avoid this duplication ? 
+        const_iterator begin() const
+        {
+                if (size_ == 0) {
+                        return end();
+                }
+                
+                return iterator_at(__find_first_occupied());
+        }
+        
+        // K is key_type, or with transparent Hash and KeyEqual, anything they take
+        template <typename K>
+        size_t __find(const K& key, bool & found) const
+        {
+                return __find_hashed(key, do_hash(key), found);
+        }
+
+        // hash is what hash_function() gives for key
+        size_t __find(const key_type& key, size_t hash, bool & found) const
+        {
+                assert(hash == hash_(key));
+                return __find_hashed(key, __seed_hash(hash), found);
+        }
+
+        template <typename K>
+        size_t __find_hashed(const K& key, size_t hash, bool & found) const
+        {
+                probe_seq seq = __probe(hash);
+                const meta * mvec = this->get_meta();
+
+                found = false;
+
+                do {
+                        const size_t i = seq.offset();
+                        uint64_t bitmap = group::match(mvec + i, 0x80 | meta_portion(hash));
+
+                        while (bitmap != 0) {
+                                size_t idx = i + __builtin_ctzll(bitmap);
+                                if (__hash_matches(idx, hash)
+                                    && eq_(key, Traits::key(__element(idx)))) {
+                                        found = true;
+                                        return idx;
+                                }
+                                bitmap &= bitmap - 1;
+                        }
+
+                        // if anything in this group was ever zero, we can stop
+                        if (group::match_empty(mvec + i)) {
+                                return 0;
+                        }
+
+                        seq.next();
+
+                } while (seq.index() != __groups()); // stop when we've seen the whole table.
+                                                     // should be rare
+
+                assert(!"corrupted table"); // load factor prevents us from ever looping all the
+                                            // way around
+                __builtin_unreachable();
+        }
+
+        // Same walk as __find, but also remembers the first insertable slot we pass on the way so
+        // that a miss doesn't have to scan the table a second time. On a miss, the returned index is
+        // where key belongs and hash is what to stamp into its metadata. This may grow the table,
+        // so any outstanding iterators are invalid afterwards. Every insert path goes through here,
+        // so the common case hashes once and walks the probe sequence once.
+        size_t __find_or_prepare_insert(const key_type& key, size_t & hash, bool & found)
+        {
+                return __find_or_prepare_insert(key, hash_(key), hash, found);
+        }
+
+        size_t __find_or_prepare_insert(const key_type& key, size_t user_hash, size_t & hash,
+                                        bool & found)
+        {
+                hash = __seed_hash(user_hash);
+                probe_seq seq = __probe(hash);
+                const meta * mvec = this->get_meta();
+                size_t insert_at = this->capacity_; // capacity_ == haven't seen one yet
+
+                found = false;
+
+                do {
+                        const size_t i = seq.offset();
+                        uint64_t bitmap = group::match(mvec + i, 0x80 | meta_portion(hash));
+
+                        while (bitmap != 0) {
+                                size_t idx = i + __builtin_ctzll(bitmap);
+                                if (__hash_matches(idx, hash)
+                                    && eq_(key, Traits::key(__element(idx)))) {
+                                        found = true;
+                                        return idx;
+                                }
+                                bitmap &= bitmap - 1;
+                        }
+
+                        if (insert_at == this->capacity_) {
+                                bitmap = group::match_not_occupied(mvec + i);
+                                if (bitmap != 0) {
+                                        insert_at = i + __builtin_ctzll(bitmap);
+                                }
+                        }
+
+                        // if anything in this group was ever zero, we can stop
+                        if (group::match_empty(mvec + i)) {
+                                break;
+                        }
+
+                        seq.next();
+
+                } while (seq.index() != __groups());
+
+                if (__wants_resize()) {
+                        if (this->is_empty_sentinel()) {
+                                __allocate_first();
+                        } else if (__resize_capacity() != this->capacity_) {
+                                __grow();
+                        } else {
+                                // mostly tombstones, so there's plenty of room if we just clean up
+                                __purge_tombstones();
+                        }
+                        // growing moves the seed along with the buffer, so the old hash is no good
+                        hash = __seed_hash(user_hash);
+                        return __find_insert_slot(hash);
+                }
+
+                assert(insert_at != this->capacity_);
+                return insert_at;
+        }
+        
+private:
+        // Batched lookups are pipelined in chunks of this many keys: hash the whole chunk and
+        // prefetch each key's first metadata group, then look at those groups and prefetch the
+        // first candidate slot, then do the real lookups. By the time we get to a key its memory
+        // should be in cache instead of taking two misses back to back.
+        static constexpr size_t __batch_size = 16;
+
+        template <typename F>
+        void __find_batch(const key_type * keys, size_t n, F&& on_result) const
+        {
+                const meta * mvec = this->get_meta();
+                const slot_type * dvec = this->get_data();
+                size_t hashes[__batch_size];
+
+                for (size_t base = 0; base < n; base += __batch_size) {
+                        const size_t count = n - base < __batch_size ? n - base : __batch_size;
+
+                        for (size_t k = 0; k < count; ++k) {
+                                hashes[k] = do_hash(keys[base + k]);
+                                __builtin_prefetch(mvec + __probe_start(hashes[k]));
+                        }
+
+                        for (size_t k = 0; k < count; ++k) {
+                                const size_t start = __probe_start(hashes[k]);
+                                uint64_t bitmap = group::match(mvec + start,
+                                                               0x80 | meta_portion(hashes[k]));
+                                if (bitmap != 0) {
+                                        __builtin_prefetch(dvec + start + __builtin_ctzll(bitmap));
+                                }
+                        }
+
+                        for (size_t k = 0; k < count; ++k) {
+                                bool found;
+                                size_t idx = __find_hashed(keys[base + k], hashes[k], found);
+                                on_result(base + k, idx, found);
+                        }
+                }
+        }
+
+public:
+        // out[i] = find(keys[i]) for each of the n keys, but much friendlier to memory when the
+        // table doesn't fit in cache
+        void find_many(const key_type * keys, size_t n, iterator * out)
+        {
+                __find_batch(keys, n, [&](size_t i, size_t idx, bool found) {
+                        out[i] = found ? iterator_at(idx) : end();
+                });
+        }
+
+        void find_many(const key_type * keys, size_t n, const_iterator * out) const
+        {
+                __find_batch(keys, n, [&](size_t i, size_t idx, bool found) {
+                        out[i] = found ? iterator_at(idx) : end();
+                });
+        }
+
+        // bit i % 64 of found[i / 64] says whether keys[i] is present. found needs room for
+        // (n + 63) / 64 words
+        void contains_many(const key_type * keys, size_t n, uint64_t * found) const
+        {
+                std::fill(found, found + (n + 63) / 64, uint64_t{0});
+                __find_batch(keys, n, [&](size_t i, size_t, bool present) {
+                        found[i / 64] |= uint64_t{present} << (i % 64);
+                });
+        }
+
+        iterator find(const key_type& key)
+        {
+                bool found;
+                size_t idx = __find(key, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        const_iterator find(const key_type& key) const
+        {
+                bool found;
+                size_t idx = __find(key, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        // The overloads taking a hash skip calling the hasher: hash has to be hash_function()(key).
+        // Each table seeds it on its own, so one hash can go to any number of tables with the same
+        // Hash, and all that's left per table is a multiply.
+        iterator find(const key_type& key, size_t hash)
+        {
+                bool found;
+                size_t idx = __find(key, hash, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        const_iterator find(const key_type& key, size_t hash) const
+        {
+                bool found;
+                size_t idx = __find(key, hash, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        void erase(const key_type& key)
+        {
+                bool found;
+                size_t idx = __find(key, found);
+                
+                if (found) {
+                        __erase_at(idx);
+                }
+        }
+
+        void erase(const key_type& key, size_t hash)
+        {
+                bool found;
+                size_t idx = __find(key, hash, found);
+
+                if (found) {
+                        __erase_at(idx);
+                }
+        }
+
+        // Erase what pos points at, with no hashing or probing, and return the element after it.
+        // Only pos is invalidated.
+        iterator erase(const_iterator pos)
+        {
+                const size_t idx = __index_of(pos);
+                __erase_at(idx);
+
+                iterator next = iterator_at(idx);
+                next.skip_unoccupied();
+                return next;
+        }
+
+        iterator erase(iterator pos)
+        {
+                return erase(const_iterator{pos});
+        }
+
+        // Erase every element pred returns true for, and return how many went. One pass over the
+        // groups: each one's occupied bitmap says which slots to ask pred about, and whether an
+        // erased slot can go straight back to empty is settled once per group. If what's left is
+        // a table the next insert would purge tombstones from anyway, that happens here instead,
+        // which moves elements around, so all iterators are invalidated.
+        template <typename Pred>
+        size_t erase_if(Pred pred)
+        {
+                if (size_ == 0) {
+                        return 0;
+                }
+
+                meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+                const size_t before = size_;
+
+                for (size_t first = 0; first < this->capacity_; first += W) {
+                        uint64_t bitmap = group::match_occupied(mvec + first);
+                        if (bitmap == 0) {
+                                continue;
+                        }
+
+                        // see __erase_at
+                        const bool to_empty = group::match_empty(mvec + first) != 0;
+                        do {
+                                const size_t idx = first + __builtin_ctzll(bitmap);
+                                bitmap &= bitmap - 1;
+                                if (!pred(static_cast<const T&>(Traits::element(dvec[idx])))) {
+                                        continue;
+                                }
+
+                                if (to_empty) {
+                                        mvec[idx].make_never_occupied();
+                                        --tombstones_;
+                                } else {
+                                        mvec[idx].make_tombstoned();
+                                }
+                                __destroy_slot(dvec + idx);
+                                --size_;
+                        } while (bitmap != 0);
+                }
+
+                if (__wants_resize() && __resize_capacity() == this->capacity_) {
+                        __purge_tombstones();
+                }
+                return before - size_;
+        }
+
+        bool contains(const key_type& key) const
+        {
+                bool found;
+                __find(key, found);
+                return found;
+        }
+
+        size_t count(const key_type& key) const
+        {
+                return contains(key) ? 1 : 0;
+        }
+
+private:
+        template <typename K, typename H>
+        using __if_transparent = typename std::enable_if<
+                __is_transparent<H, key_equal>::value && !std::is_convertible<K, iterator>::value
+                && !std::is_convertible<K, const_iterator>::value>::type;
+
+public:
+        // Transparent lookups: when both Hash and KeyEqual have is_transparent, these take anything
+        // they can hash and compare against a key_type (say a string_view into a set of strings),
+        // with no temporary key_type built.
+        template <typename K, typename H = hasher, typename = __if_transparent<K, H>>
+        iterator find(const K& key)
+        {
+                bool found;
+                size_t idx = __find(key, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        template <typename K, typename H = hasher, typename = __if_transparent<K, H>>
+        const_iterator find(const K& key) const
+        {
+                bool found;
+                size_t idx = __find(key, found);
+
+                return found ? iterator_at(idx) : end();
+        }
+
+        template <typename K, typename H = hasher, typename = __if_transparent<K, H>>
+        bool contains(const K& key) const
+        {
+                bool found;
+                __find(key, found);
+                return found;
+        }
+
+        template <typename K, typename H = hasher, typename = __if_transparent<K, H>>
+        size_t count(const K& key) const
+        {
+                return contains(key) ? 1 : 0;
+        }
+
+        template <typename K, typename H = hasher, typename = __if_transparent<K, H>>
+        void erase(const K& key)
+        {
+                bool found;
+                size_t idx = __find(key, found);
+
+                if (found) {
+                        __erase_at(idx);
+                }
+        }
+
+private:
+        void __erase_at(size_t idx)
+        {
+                assert(size_ > 0);
+
+                meta * mvec = this->get_meta();
+                assert(mvec[idx].is_occupied());
+
+                // Probes only walk past a group if it had no never-occupied slot at the time. Slots
+                // only go back to never-occupied through this path, which needs one to already be
+                // in the group, so if this group has one now, no probe sequence for anything in
+                // the table runs through it and we can hand the slot straight back instead of
+                // tombstoning it.
+                if (group::match_empty(mvec + (idx & ~(W - 1)))) {
+                        mvec[idx].make_never_occupied();
+                        --tombstones_;
+                } else {
+                        mvec[idx].make_tombstoned();
+                }
+
+                __destroy_slot(this->get_data() + idx);
+                --size_;
+
+                // don't shrink because we don't want to invalidate iterators. gross. shrink_to_fit()
+                // does it on request.
+        }
+
+        size_t __make_seed() const
+        {
+                // seed with ASLR and some random bits. last part from
+                // https://www.random.org/cgi-bin/randbyte?nbytes=8&format=h
+                // (you won't get the same result, read the url...)
+                return (reinterpret_cast<size_t>(this->__get_mem()) >> 12) ^ 0xf58e33ad9e13e5c1;
+        }
+
+        __attribute__((noinline, cold))
+        void __allocate_first()
+        {
+                this->allocate_sentinel(W);
+                seed_ = __make_seed();
+                tombstones_ = 0;
+        }
+
+        __attribute__((noinline))
+        void __grow()
+        {
+                __resize(__grown_capacity());
+        }
+
+        size_t __grown_capacity() const
+        {
+                return __pow2 ? this->capacity_ * 2
+                              : sanitize_capacity(this->capacity_ + this->capacity_ / 2);
+        }
+
+        // move everything into a new buffer of capacity cap, which has to be big enough
+        void __resize(size_t cap)
+        {
+                assert(cap >= __capacity_for(size_));
+                hash_table other{cap, hash_, eq_, this->get_allocator()};
+                if (__stores_hash && size_ > 0) {
+                        other.seed_ = seed_;
+                }
+
+                meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+                slot_type * odvec = other.get_data();
+                for (size_t i = 0; i < this->capacity_; i += W) {
+                        uint64_t bitmap = group::match_occupied(mvec + i);
+                        while (bitmap != 0) {
+                                const size_t idx = i + __builtin_ctzll(bitmap);
+                                bitmap &= bitmap - 1;
+
+                                // everything in here is already unique, so skip straight to
+                                // finding a slot
+                                const size_t hash = __hash_for(other, dvec[idx]);
+                                const size_t slot = other.__find_insert_slot(hash);
+                                __transfer_slot(dvec + idx, other, odvec + slot);
+                                other.__occupy(slot, hash);
+                        }
+                }
+
+                // everything moved out. Forget it was ever here, so nothing gets destroyed or freed
+                // twice when the old buffer goes
+                if (!this->is_empty_sentinel()) {
+                        memset(static_cast<void *>(mvec), 0, this->capacity_);
+                }
+                swap(other);
+        }
+
+public:
+        // Make room for n elements: after this, the next n - size() inserts don't resize or move
+        // anything (so iterators stay valid), as long as nothing gets erased in between. Erases
+        // leave tombstones behind, which count against the load just like elements do, so churn
+        // can still bring on a resize or a purge before size() gets to n.
+        void reserve(size_t n)
+        {
+                if (this->is_empty_sentinel()) {
+                        if (n > 0) {
+                                __resize(__capacity_for(n));
+                        }
+                        return;
+                }
+
+                n = std::max(n, size_);
+                // tombstones_ goes up by at most one per insert, and an insert only resizes
+                // when the table was already more than 0.7 full
+                const size_t worst = tombstones_ + (n - size_);
+                if (worst == 0 || (worst - 1) * 10 <= this->capacity_ * 7) {
+                        return;
+                }
+                rehash(std::max(__capacity_for(n), this->capacity_));
+        }
+
+        // Rebuild with capacity at least n (and at least enough for size()), clearing out all the
+        // tombstones. Like std::unordered_set::rehash, this can shrink the table.
+        void rehash(size_t n)
+        {
+                if (n == 0 && this->is_empty_sentinel()) {
+                        // nothing to rebuild, and no reason to allocate
+                        return;
+                }
+                const size_t cap = std::max(sanitize_capacity(n), __capacity_for(size_));
+                if (cap == this->capacity_ && !this->is_empty_sentinel()) {
+                        __purge_tombstones();
+                } else {
+                        __resize(cap);
+                }
+        }
+
+        // Give back memory after a lot of erases. No-op if the table is already as small as it can
+        // be for its size.
+        void shrink_to_fit()
+        {
+                if (__capacity_for(size_) < this->capacity_) {
+                        __resize(__capacity_for(size_));
+                }
+        }
+
+private:
+
+        // Rehash into the same buffer, turning every tombstone back into an empty slot. Same idea
+        // as abseil's drop_deletes_without_resize: mark everything live as pending, then walk the
+        // table and put each pending element in the first non-occupied slot on its probe sequence.
+        // If that slot holds another pending element, the two trade places and we go around again
+        // on the one we just picked up. No allocation, and only elements that actually need to
+        // move get moved.
+        __attribute__((noinline))
+        void __purge_tombstones()
+        {
+                meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+
+                for (size_t i = 0; i < this->capacity_; ++i) {
+                        if (mvec[i].is_occupied()) {
+                                mvec[i].make_pending();
+                        } else {
+                                mvec[i].make_never_occupied();
+                        }
+                }
+
+                for (size_t i = 0; i < this->capacity_; ++i) {
+                        while (mvec[i].is_pending()) {
+                                const size_t hash = __hash_for(*this, dvec[i]);
+                                // pending isn't occupied, so this finds empties and pending slots
+                                const size_t target = __find_insert_slot(hash);
+
+                                // already in the first group it could live in: nothing to do.
+                                // i is pending, so target's group is i's or one before it.
+                                if ((target & ~(W - 1)) == (i & ~(W - 1))) {
+                                        mvec[i].make_occupied(meta_portion(hash));
+                                        break;
+                                }
+
+                                if (mvec[target].is_never_occupied()) {
+                                        this->construct(dvec + target, std::move(dvec[i]));
+                                        this->destroy(dvec + i);
+                                        mvec[target].make_occupied(meta_portion(hash));
+                                        mvec[i].make_never_occupied();
+                                        break;
+                                }
+
+                                // target is pending, swap and keep going on i
+                                assert(mvec[target].is_pending());
+                                slot_type tmp(std::move(dvec[i]));
+                                this->destroy(dvec + i);
+                                this->construct(dvec + i, std::move(dvec[target]));
+                                this->destroy(dvec + target);
+                                this->construct(dvec + target, std::move(tmp));
+                                mvec[target].make_occupied(meta_portion(hash));
+                        }
+                }
+
+                tombstones_ = size_;
+        }
+
+        // probe sequence for hash
+        probe_seq __probe(size_t hash) const
+        {
+                if (__pow2) {
+                        return probe_seq{index_portion(hash) & (this->capacity_ - 1) & ~(W - 1),
+                                         this->capacity_};
+                }
+                // fastrange wants the top bits, and the metadata only takes the bottom 7
+                return probe_seq{__fastrange(hash, __groups()) * W, this->capacity_};
+        }
+
+        size_t __groups() const
+        {
+                return this->capacity_ / W;
+        }
+
+        // group aligned slot the probe sequence for hash starts at
+        size_t __probe_start(size_t hash) const
+        {
+                return __probe(hash).offset();
+        }
+
+        // how many groups into hash's probe sequence the slot idx is
+        size_t __probe_distance(size_t hash, size_t idx) const
+        {
+                probe_seq seq = __probe(hash);
+                while (seq.offset() != (idx & ~(W - 1))) {
+                        seq.next();
+                        assert(seq.index() < __groups());
+                }
+                return seq.index();
+        }
+
+        // first slot an element with this hash could go in. Only for keys we know aren't present.
+        size_t __find_insert_slot(size_t hash) const
+        {
+                probe_seq seq = __probe(hash);
+                const meta * mvec = this->get_meta();
+                
+                do {
+                        const size_t i = seq.offset();
+                        uint64_t bitmap = group::match_not_occupied(mvec + i);
+                        if (bitmap != 0) {
+                                return i + __builtin_ctzll(bitmap);
+                        }
+
+                        seq.next();
+                } while (seq.index() != __groups());
+
+                // we never get here, we always find a slot
+                assert(!"corrupted table");
+                __builtin_unreachable();
+        }
+
+protected:
+        // construct a new element in an insertable slot handed out by __find_insert_slot or
+        // __find_or_prepare_insert. The slot is only marked once the element is there, so a
+        // throwing constructor leaves the table as it was.
+        template <typename... Ts>
+        iterator __emplace_at(size_t idx, size_t hash, Ts&& ... args)
+        {
+                __construct_slot(this->get_data() + idx, hash, std::forward<Ts>(args)...);
+                __occupy(idx, hash);
+                return iterator_at(idx);
+        }
+
+        // bookkeeping half of __emplace_at, for after the caller has put the element in the slot
+        void __occupy(size_t idx, size_t hash)
+        {
+                meta * mvec = this->get_meta();
+                assert(mvec[idx].is_insertable());
+
+                // this slot has never been tombstoned before, so we got a new ts
+                // once we eventaully erase things. We morbidly consider live values
+                // as tombstones so that the tombstones_ count basically counts all
+                // slots that an insert might have to consider, which is what we
+                // want to know in load factor
+                if (mvec[idx].is_never_occupied())
+                        ++tombstones_;
+
+                mvec[idx].make_occupied(meta_portion(hash));
+                ++size_;
+        }
+
+private:
+        // insert for T& and T&&. 
+        template <typename U>
+        std::pair<iterator,bool> __insert(U&& val)
+        {
+                return __insert(std::forward<U>(val), hash_(Traits::key(val)));
+        }
+
+        template <typename U>
+        std::pair<iterator,bool> __insert(U&& val, size_t user_hash)
+        {
+                size_t hash;
+                bool found;
+                const size_t idx = __find_or_prepare_insert(Traits::key(val), user_hash, hash,
+                                                            found);
+                if (found) {
+                        return std::make_pair(iterator_at(idx), false);
+                }
+
+                return std::make_pair(__emplace_at(idx, hash, std::forward<U>(val)), true);
+        }
+
+public:
+        std::pair<iterator,bool> insert(const T& val)
+        {
+                return __insert(val);
+        }
+        
+        std::pair<iterator,bool> insert(T&& val)
+        {
+                return __insert(std::move(val));
+        }
+
+        // hash is hash_function()(key of val), see find(key, hash)
+        std::pair<iterator,bool> insert(const T& val, size_t hash)
+        {
+                assert(hash == hash_(Traits::key(val)));
+                return __insert(val, hash);
+        }
+
+        std::pair<iterator,bool> insert(T&& val, size_t hash)
+        {
+                assert(hash == hash_(Traits::key(val)));
+                return __insert(std::move(val), hash);
+        }
+
+        template <typename... Ts>
+        std::pair<iterator,bool> emplace(Ts&& ... args)
+        {
+                T val{std::forward<Ts>(args)...};
+                return __insert(std::move(val));
+        }
+        
+        size_t size() const
+        {
+                return size_;
+        }
+
+        // 0 until something's been inserted into a default constructed table
+        size_t capacity() const
+        {
+                return this->is_empty_sentinel() ? 0 : this->capacity_;
+        }
+
+private:
+        size_t index_portion(size_t hash) const
+        {
+                return hash >> 7;
+        }
+
+        uint8_t meta_portion(size_t hash) const
+        {
+                return hash & 0x7f;
+        }
+        
+        template <typename K>
+        size_t do_hash(const K& key) const
+        {
+                return __seed_hash(hash_(key));
+        }
+
+        size_t __seed_hash(size_t user_hash) const
+        {
+                // seed the hash, then mix it so both meta_portion and index_portion depend on
+                // every bit of the user's hash
+                return __hash_mix(user_hash ^ seed_);
+        }
+        
+        double __size_load() const
+        {
+                return size_/double(this->capacity_);
+        }
+
+public:
+        double load() const
+        {
+                return this->is_empty_sentinel() ? 0.0 : tombstones_/double(this->capacity_);
+        }
+
+        // Whether the next insert of a new key resizes, and the capacity it would resize to (the
+        // same capacity means just clearing out tombstones). For wrappers that want to move the
+        // elements themselves, like incremental_hash_set.
+        bool __wants_resize() const
+        {
+                // load() > 0.7, without the divide
+                return tombstones_ * 10 > this->capacity_ * 7;
+        }
+
+        size_t __resize_capacity() const
+        {
+                // xxx: revisit these constants.
+                return __size_load() > 0.4 ? __grown_capacity() : this->capacity_;
+        }
+
+        // Move every element in the group starting at slot first into dst, leaving tombstones
+        // behind so lookups of whatever is left here still walk past it.
+        void __migrate_group(size_t first, hash_table & dst)
+        {
+                assert(first % W == 0 && first < this->capacity_);
+
+                meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+                uint64_t bitmap = group::match_occupied(mvec + first);
+                while (bitmap != 0) {
+                        const size_t idx = first + __builtin_ctzll(bitmap);
+                        const size_t hash = __hash_for(dst, dvec[idx]);
+                        const size_t slot = dst.__find_insert_slot(hash);
+                        __transfer_slot(dvec + idx, dst, dst.get_data() + slot);
+                        dst.__occupy(slot, hash);
+                        mvec[idx].make_tombstoned();
+                        --size_;
+                        bitmap &= bitmap - 1;
+                }
+        }
+
+        // How many groups a successful lookup of each current element walks (1 == found in the
+        // first group probed). For judging how well a hash spreads a given key set.
+        struct probe_stats {
+                double mean;
+                size_t max;
+        };
+
+        probe_stats __probe_stats() const
+        {
+                probe_stats stats{0.0, 0};
+                if (size_ == 0) {
+                        return stats;
+                }
+
+                size_t total = 0;
+                for (auto it = begin(); it != end(); ++it) {
+                        const size_t hash = do_hash(Traits::key(*it));
+                        const size_t len = __probe_distance(hash, __index_of(it)) + 1;
+                        total += len;
+                        stats.max = std::max(stats.max, len);
+                }
+                stats.mean = total / double(size_);
+                return stats;
+        }
+
+        void swap(hash_table & rhs)
+        {
+                constexpr bool pocs = alloc_traits::propagate_on_container_swap::value;
+                assert(pocs || this->same_allocator(rhs));
+                __swap(rhs, pocs);
+        }
+
+private:
+        // swap everything, allocators included if with_alloc (see hash_set_mem::swap_storage)
+        void __swap(hash_table & rhs, bool with_alloc)
+        {
+                using std::swap;
+                this->swap_storage(rhs, with_alloc);
+                swap(hash_, rhs.hash_);
+                swap(eq_, rhs.eq_);
+                std::swap(size_, rhs.size_);
+                std::swap(tombstones_, rhs.tombstones_);
+                std::swap(seed_, rhs.seed_);
         }
 
-        const_iterator end() const
+        // Move the elements over one at a time, for when the buffer can't come along. They stay
+        // behind here moved-from.
+        void __move_elements_to(hash_table & dst)
         {
-                return iterator_at(this->capacity_);
+                const meta * mvec = this->get_meta();
+                slot_type * dvec = this->get_data();
+                for (size_t i = 0; i < this->capacity_; i += W) {
+                        uint64_t bitmap = group::match_occupied(mvec + i);
+                        while (bitmap != 0) {
+                                const size_t idx = i + __builtin_ctzll(bitmap);
+                                dst.insert(std::move(Traits::element(dvec[idx])));
+                                bitmap &= bitmap - 1;
+                        }
+                }
         }
 
-        // xxx: can we avoid this duplication ? 
-        const_iterator begin() const
+public:
+
+        // Write a snapshot that mapped_hash_set can open without rebuilding anything. Only for
+        // elements that can be memcpy'd, which rules out nodes.
+        void save(const char * path) const
         {
-                if (size_ == 0) {
-                        return end();
+                static_assert(__bytewise_copy, "save() needs trivially copyable flat elements");
+                static_assert(base_t::alignment <= sizeof(__ht_file_header),
+                              "slots need more alignment than the file gives them");
+
+                __ht_file_header h{};
+                memcpy(h.magic, __ht_file_magic, sizeof(h.magic));
+                h.version = __ht_file_version;
+                h.group_width = W;
+                h.probing = __probing_id;
+                h.slot_size = sizeof(slot_type);
+                if (!this->is_empty_sentinel()) {
+                        h.capacity = this->capacity_;
+                        h.size = size_;
+                        h.tombstones = tombstones_;
+                        h.seed = seed_;
+                        h.checksum = hash_bytes(this->__get_mem(), this->mem_size());
+                }
+
+                FILE * f = fopen(path, "wb");
+                if (!f) {
+                        throw std::runtime_error{std::string{"hash_table::save: "}
+                                                 + strerror(errno)};
+                }
+                bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+                if (ok && h.capacity != 0) {
+                        ok = fwrite(this->__get_mem(), this->mem_size(), 1, f) == 1;
+                }
+                ok = fclose(f) == 0 && ok;
+                if (!ok) {
+                        throw std::runtime_error{"hash_table::save: short write"};
                 }
-                
-                return iterator_at(__find_first_occupied());
         }
-        
-        size_t __find(const T& val, bool & found) const
+
+        friend std::ostream& operator<<(std::ostream& os, const hash_table& set)
         {
-                const size_t hash = do_hash(val);
-                // need 16 byte allignment for _mm_load_si128
-                const size_t start = (index_portion(hash) % this->capacity_) & ~size_t{0xf};
-                size_t i = start;
-                const meta * mvec = this->get_meta();
+                const meta * mvec = set.get_meta();
+                for (size_t i = 0; i < set.capacity(); ++i) {
+                        os << std::hex << std::setfill('0') << std::setw(2)
+                           << int(mvec[i].m_);
 
-                found = false;
+                        if (i != set.capacity() - 1) {
+                                os << " ";
+                        }
+                }
+                return os;
+        }
+};
 
-                do {
-                        const __m128i * mem = reinterpret_cast<const __m128i *>(mvec + i);
-                        const __m128i group = _mm_load_si128(mem);
-                        const __m128i search = _mm_set1_epi8(0x80 | meta_portion(hash));
+template <typename Traits>
+void swap(hash_table<Traits> & lhs, hash_table<Traits> & rhs)
+{
+        lhs.swap(rhs);
+}
 
-                        int bitmap = _mm_movemask_epi8(_mm_cmpeq_epi8(search, group));
+// Hash, KeyEqual and Allocator mean the same thing they do for std::unordered_set, except Hash
+// defaults to ht_hash, which is std::hash plus a fast path for contiguous keys. GroupWidth is
+// how many metadata bytes a probe looks at in one go: 16, 32 or 64. Wider groups take fewer trips
+// around the probe loop at high load, and scan faster when iterating. Storage picks between
+// elements in the slots and elements in their own nodes (see slot_storage). InlineGroup keeps a
+// table of one group inside the object, so small sets never allocate, at the cost of a bigger
+// object and elements that move when the set is moved or swapped. StoreHash keeps each element's
+// full hash next to it, for keys that are expensive to hash or compare. Probe is linear_probing or
+// triangular_probing, and Sizing is pow2_sizing or compact_sizing, see there.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16,
+          slot_storage Storage = slot_storage::automatic, bool InlineGroup = false,
+          bool StoreHash = false, typename Probe = linear_probing,
+          typename Sizing = pow2_sizing>
+using hash_set = hash_table<__set_traits<T, Hash, KeyEqual, Allocator, GroupWidth, Storage,
+                                         InlineGroup, StoreHash, Probe, Sizing>>;
+
+// hash_set with every element in its own node: references stay good across rehashes
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+using node_hash_set = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth, slot_storage::node>;
+
+// hash_set that holds up to 12 elements (one group, under the load limit) without allocating
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>>
+using small_hash_set = hash_set<T, Hash, KeyEqual, Allocator, 16, slot_storage::automatic, true>;
+
+// hash_set that never rehashes a key once it's in, and only compares keys whose full hash matches
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+using stored_hash_set = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth,
+                                 slot_storage::automatic, false, true>;
+
+// hash_set that grows by 1.5x into any multiple of the group width, for big sets where rounding up
+// to a power of two wastes too much
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+using compact_hash_set = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth,
+                                  slot_storage::automatic, false, false, linear_probing,
+                                  compact_sizing>;
+
+// A key -> value map in the same open addressed layout as hash_set. Every entry point that can add
+// a key does exactly one probe via __find_or_prepare_insert.
+template <typename K, typename V, typename Hash = ht_hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>, size_t GroupWidth = 16,
+          slot_storage Storage = slot_storage::automatic, bool InlineGroup = false,
+          bool StoreHash = false, typename Probe = linear_probing,
+          typename Sizing = pow2_sizing>
+class hash_map
+        : public hash_table<__map_traits<K, V, Hash, KeyEqual, Allocator, GroupWidth, Storage,
+                                         InlineGroup, StoreHash, Probe, Sizing>>
+{
+        using base_t = hash_table<__map_traits<K, V, Hash, KeyEqual, Allocator, GroupWidth,
+                                               Storage, InlineGroup, StoreHash, Probe, Sizing>>;
 
-                        while (bitmap != 0) {
-                                int bit = __builtin_ffs(bitmap) - 1;
-                                size_t idx = i + bit;
-                                const T & v= this->get_data()[idx];
-                                if (val == v) {
-                                        found = true;
-                                        return idx;
-                                }
-                                bitmap ^= (1 << bit); // builtin for this?
-                        }
+public:
+        using mapped_type = V;
+        using typename base_t::key_type;
+        using typename base_t::value_type;
+        using typename base_t::iterator;
+        using typename base_t::const_iterator;
 
-                        // if anything in this group was ever zero, we can stop
-                        bitmap = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(0x00), group));
-                        if (bitmap) {
-                                return 0;
-                        }
+        using base_t::base_t;
 
-                        i = (i + 16) % this->capacity_;
+        hash_map() : base_t()
+        {}
 
-                } while (i != start); // stop when we've looped around the whole table. should be
-                                      // rare
+        V& operator[](const K& key)
+        {
+                return (*try_emplace(key).first).second;
+        }
 
-                assert(!"corrupted table"); // load factor prevents us from ever looping all the
-                                            // way around
-                __builtin_unreachable();
+        V& operator[](K&& key)
+        {
+                return (*try_emplace(std::move(key)).first).second;
         }
-        
-        iterator find(const T& val)
+
+        V& at(const K& key)
         {
                 bool found;
-                size_t idx = __find(val, found);
+                size_t idx = this->__find(key, found);
+                if (!found) {
+                        throw std::out_of_range{"hash_map::at"};
+                }
+                return this->__element(idx).second;
+        }
 
-                return found ? iterator_at(idx) : end();
+        const V& at(const K& key) const
+        {
+                bool found;
+                size_t idx = this->__find(key, found);
+                if (!found) {
+                        throw std::out_of_range{"hash_map::at"};
+                }
+                return this->__element(idx).second;
+        }
+
+        template <typename... Ts>
+        std::pair<iterator,bool> try_emplace(const K& key, Ts&& ... args)
+        {
+                return __try_emplace(key, std::forward<Ts>(args)...);
+        }
+
+        template <typename... Ts>
+        std::pair<iterator,bool> try_emplace(K&& key, Ts&& ... args)
+        {
+                return __try_emplace(std::move(key), std::forward<Ts>(args)...);
+        }
+
+        template <typename M>
+        std::pair<iterator,bool> insert_or_assign(const K& key, M&& obj)
+        {
+                return __insert_or_assign(key, std::forward<M>(obj));
         }
 
-        const_iterator find(const T& val) const
+        template <typename M>
+        std::pair<iterator,bool> insert_or_assign(K&& key, M&& obj)
         {
-                return find(val); // XXX: const violation, right?
+                return __insert_or_assign(std::move(key), std::forward<M>(obj));
         }
 
-        void erase(const T& val)
+private:
+        // key is only consumed if we actually insert
+        template <typename KK, typename... Ts>
+        std::pair<iterator,bool> __try_emplace(KK&& key, Ts&& ... args)
         {
+                size_t hash;
                 bool found;
-                size_t idx = __find(val, found);
-                
+                size_t idx = this->__find_or_prepare_insert(key, hash, found);
                 if (found) {
-                        assert(size_ > 0);
-                        
-                        this->get_meta()[idx].make_tombstoned();
-                        this->get_data()[idx].~T();
-                        --size_;
-
-                        // don't shrink because we don't want to invalidate iterators. gross.
+                        return std::make_pair(this->iterator_at(idx), false);
                 }
+
+                return std::make_pair(this->__emplace_at(idx, hash, std::piecewise_construct,
+                                                         std::forward_as_tuple(std::forward<KK>(key)),
+                                                         std::forward_as_tuple(std::forward<Ts>(args)...)),
+                                      true);
         }
 
-private:
-        // insert for T& and T&&. 
-        template <typename U>
-        std::pair<iterator,bool> __insert(U&& val)
+        template <typename KK, typename M>
+        std::pair<iterator,bool> __insert_or_assign(KK&& key, M&& obj)
         {
-                // xxx: this find basically does all the scanning of the insert below,
-                // we could avoid that with a good helper...
-                iterator where = find(val);
-                if (where != end()) {
-                        return std::make_pair(where, false);
+                size_t hash;
+                bool found;
+                size_t idx = this->__find_or_prepare_insert(key, hash, found);
+                if (found) {
+                        this->__element(idx).second = std::forward<M>(obj);
+                        return std::make_pair(this->iterator_at(idx), false);
                 }
 
-                if (load() > 0.7) {
-                        // xxx: revisit these constants. 
-                        hash_set bigger{__size_load() > 0.4 ? this->capacity_ * 2 : this->capacity_};
+                return std::make_pair(this->__emplace_at(idx, hash, std::forward<KK>(key),
+                                                         std::forward<M>(obj)),
+                                      true);
+        }
+};
 
-                        meta * mvec = this->get_meta();
-                        T * dvec = this->get_data();
-                        for (iterator i = begin(); i != end(); ++i) {
-                                bigger.insert(std::move(dvec[i.offset]));
-                                mvec[i.offset].make_tombstoned();
-                        }
+template <typename K, typename V, typename Hash = ht_hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>, size_t GroupWidth = 16>
+using node_hash_map = hash_map<K, V, Hash, KeyEqual, Allocator, GroupWidth, slot_storage::node>;
+
+template <typename K, typename V, typename Hash = ht_hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>>
+using small_hash_map = hash_map<K, V, Hash, KeyEqual, Allocator, 16, slot_storage::automatic,
+                                true>;
+
+template <typename K, typename V, typename Hash = ht_hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>, size_t GroupWidth = 16>
+using stored_hash_map = hash_map<K, V, Hash, KeyEqual, Allocator, GroupWidth,
+                                 slot_storage::automatic, false, true>;
+
+template <typename K, typename V, typename Hash = ht_hash<K>, typename KeyEqual = std::equal_to<K>,
+          typename Allocator = std::allocator<std::pair<const K, V>>, size_t GroupWidth = 16>
+using compact_hash_map = hash_map<K, V, Hash, KeyEqual, Allocator, GroupWidth,
+                                  slot_storage::automatic, false, false, linear_probing,
+                                  compact_sizing>;
+
+// A hash_set that never resizes all at once. When the table fills up, a new one is allocated next
+// to it and every insert or erase after that moves a few groups over, so no single operation pays
+// for more than groups_per_step groups' worth of moves. Lookups check both tables until the old
+// one is empty. Costs some memory (both tables are live while migrating) and a second probe on
+// misses while migrating, in exchange for a flat insert latency.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+class incremental_hash_set
+{
+public:
+        using set_type = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth>;
+        using key_type = T;
+        using value_type = T;
+        using hasher = Hash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+
+private:
+        static constexpr size_t W = GroupWidth;
 
-                        swap(bigger);
+        set_type cur_;
+        set_type old_;          // being drained into cur_, if migrating()
+        size_t next_group_;     // first slot of the next group of old_ to move, == capacity when done
+        size_t groups_per_step_;
+
+        void step()
+        {
+                if (!migrating()) {
+                        return;
                 }
 
-                const size_t hash = do_hash(val);
-                // need 16 byte allignment for _mm_load_si128
-                const size_t start = (index_portion(hash) % this->capacity_) & ~size_t{0xf};
+                for (size_t i = 0; i < groups_per_step_ && next_group_ < old_.capacity(); ++i) {
+                        old_.__migrate_group(next_group_, cur_);
+                        next_group_ += W;
+                }
 
-                se_t i = start;
-                meta * mvec = this->get_meta();
-                
-                do {
-                        const __m128i * mem = reinterpret_cast<const __m128i *>(mvec + i);
-                        const __m128i group = _mm_load_si128(mem);
-                        const __m128i masked = _mm_and_si128(group, _mm_set1_epi8(0x80));
+                if (next_group_ == old_.capacity()) {
+                        assert(old_.size() == 0);
+                        set_type{0, cur_.hash_function(), cur_.key_eq(),
+                                 cur_.get_allocator()}.swap(old_);
+                        next_group_ = old_.capacity();
+                }
+        }
 
-                        int bitmap = _mm_movemask_epi8(_mm_cmpeq_epi8(masked, _mm_set1_epi8(0x00)));
-                        if (bitmap != 0) {
-                                int bit = __builtin_ffs(bitmap) - 1;
-                                size_t idx = i + bit;
+        // Start moving to a new table if the next insert would resize. The new table is big enough
+        // that it won't need to resize itself before the old one is drained: even clearing out
+        // tombstones in place leaves it at most 0.4 full, and a migration is over after
+        // capacity / (W * groups_per_step) operations.
+        void maybe_start_migration()
+        {
+                if (migrating() || !cur_.__wants_resize()) {
+                        return;
+                }
 
-                                meta m{static_cast<uint8_t>(_mm_extract_epi8(group, bit))};
+                set_type next{cur_.__resize_capacity(), cur_.hash_function(), cur_.key_eq(),
+                              cur_.get_allocator()};
+                cur_.swap(old_);
+                cur_.swap(next);
+                next_group_ = 0;
+        }
 
-                                // this slot has never been tombstoned before, so we got a new ts
-                                // once we eventaully erase things. We morbidly consider live values
-                                // as tombstones so that the tombstones_ count basically counts all
-                                // slots that an insert might have to consider, which is what we
-                                // want to know in load factor
-                                if (m.is_never_occupied())
-                                        ++tombstones_;
+        template <typename U>
+        bool __insert(U&& val)
+        {
+                step();
+                maybe_start_migration();
+                if (migrating() && old_.find(val) != old_.end()) {
+                        return false;
+                }
+                return cur_.insert(std::forward<U>(val)).second;
+        }
 
-                                mvec[idx].make_occupied(meta_portion(hash));
-                                new (this->get_data() + idx) T{std::forward<U>(val)};
-                                ++size_;
-                                return std::make_pair(iterator_at(idx), true);
-                        }
+public:
+        explicit incremental_hash_set(size_t capacity = W, size_t groups_per_step = 2,
+                                      const hasher& hash = hasher(),
+                                      const key_equal& eq = key_equal(),
+                                      const allocator_type& alloc = allocator_type())
+                : cur_{capacity, hash, eq, alloc}, old_{0, hash, eq, alloc},
+                  next_group_{old_.capacity()},
+                  groups_per_step_{groups_per_step ? groups_per_step : 1}
+        {}
 
-                        i = (i + 16) % this->capacity_;
-                } while (i != start);
+        bool migrating() const
+        {
+                return next_group_ != old_.capacity();
+        }
 
-                // we never get here, we always find a slot
-                assert(!"corrupted table");
-                __builtin_unreachable();
+        bool contains(const key_type& key) const
+        {
+                return cur_.find(key) != cur_.end()
+                        || (migrating() && old_.find(key) != old_.end());
         }
 
-public:
-        std::pair<iterator,bool> insert(const T& val)
+        // true if val wasn't there already
+        bool insert(const T& val)
         {
                 return __insert(val);
         }
-        
-        std::pair<iterator,bool> insert(T&& val)
+
+        bool insert(T&& val)
         {
                 return __insert(std::move(val));
         }
 
-        template <typename... Ts>
-        std::pair<iterator,bool> emplace(Ts&& ... args)
+        void erase(const key_type& key)
         {
-                T val{std::forward<Ts>(args)...};
-                return __insert(std::move(val));
+                step();
+                cur_.erase(key);
+                if (migrating()) {
+                        old_.erase(key);
+                }
         }
-        
+
         size_t size() const
         {
-                return size_;
+                return cur_.size() + (migrating() ? old_.size() : 0);
         }
 
+        // capacity of the table new elements go into
         size_t capacity() const
         {
-                return this->capacity_;
+                return cur_.capacity();
+        }
+
+        template <typename F>
+        void for_each(F&& f) const
+        {
+                for (const auto& v : cur_) {
+                        f(v);
+                }
+                if (migrating()) {
+                        for (const auto& v : old_) {
+                                f(v);
+                        }
+                }
         }
+};
+
+// A set that's built once from a range and then only read, for allowlists, config keys and the
+// like. There's no insert or erase, so there's also no load factor slack in the elements, no
+// tombstones and no probe sequence:
+//
+// * Elements are packed into one array, sorted by group. Each group is 16 metadata bytes (the same
+//   tags hash_set uses, scanned with the same kernels) plus where its elements start in the array.
+//   The only slack is in the metadata, at a byte per empty slot.
+//
+// * Every key can live in exactly two groups. Building places each key in its first group if
+//   there's room and its second otherwise, trying a few seeds and then more groups until every
+//   key fits. A group whose keys spilled gets a flag, so a lookup scans its first group, and only
+//   looks at the second one if the flag says something from here went there. Two group scans at
+//   most, no loop.
+//
+// The seed search is deterministic, so the same keys always give the same layout. A hash that
+// gives more than 2 * 16 keys the same value can't be placed at all, and building throws
+// std::invalid_argument.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>>
+class frozen_hash_set
+{
+public:
+        using key_type = T;
+        using value_type = T;
+        using hasher = Hash;
+        using key_equal = KeyEqual;
+        using allocator_type = Allocator;
+        using const_iterator = const T *;
+        using iterator = const_iterator;
 
 private:
-        size_t index_portion(size_t hash) const
+        static constexpr size_t W = 16;
+        using group = __group<W>;
+        using byte_alloc_t = typename std::allocator_traits<Allocator>::template rebind_alloc<uint8_t>;
+        using byte_traits = std::allocator_traits<byte_alloc_t>;
+        using value_alloc_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        using value_traits = std::allocator_traits<value_alloc_t>;
+
+        // Keys per group to start the search at. xxx: with 16 slots and one step of moving keys
+        // aside, 12 fits in one or two seeds for anything we've tried; much fuller and a lot of
+        // lookups need the second group.
+        static constexpr size_t __target_per_group = 12;
+        static constexpr size_t __seeds_per_size = 4;
+
+        // top bit of a group's offset: something that hashes here lives in its second group
+        static constexpr uint32_t __spilled = uint32_t{1} << 31;
+        static constexpr uint32_t __no_offsets[1] = {0};
+
+        hasher hash_;
+        key_equal eq_;
+        byte_alloc_t alloc_;
+        uint8_t * raw_ = nullptr;
+        size_t raw_size_ = 0;
+        const uint8_t * meta_ = __empty_group<>::bytes;
+        const uint32_t * offsets_ = __no_offsets;
+        T * data_ = nullptr;
+        size_t groups_ = 1;
+        size_t size_ = 0;
+        size_t seed_ = 0;
+
+public:
+        template <typename It>
+        frozen_hash_set(It first, It last, const hasher& hash = hasher(),
+                        const key_equal& eq = key_equal(),
+                        const allocator_type& alloc = allocator_type())
+                : hash_(hash), eq_(eq), alloc_(alloc)
         {
-                return hash >> 7;
+                // duplicates out first, so the layout only has to deal with distinct keys
+                hash_set<T, Hash, KeyEqual, Allocator> uniq{0, hash, eq, alloc};
+                for (; first != last; ++first) {
+                        uniq.insert(*first);
+                }
+                __build(uniq);
         }
 
-        uint8_t meta_portion(size_t hash) const
+        frozen_hash_set(std::initializer_list<T> init, const hasher& hash = hasher(),
+                        const key_equal& eq = key_equal(),
+                        const allocator_type& alloc = allocator_type())
+                : frozen_hash_set(init.begin(), init.end(), hash, eq, alloc)
+        {}
+
+        frozen_hash_set() : frozen_hash_set(static_cast<const T *>(nullptr),
+                                            static_cast<const T *>(nullptr))
+        {}
+
+        frozen_hash_set(frozen_hash_set&& rhs)
+                : hash_(rhs.hash_), eq_(rhs.eq_), alloc_(rhs.alloc_)
         {
-                return hash & 0x7f;
+                swap(rhs);
         }
-        
-        // XXX: do better
-        size_t do_hash(const T& val) const
+
+        frozen_hash_set& operator=(frozen_hash_set&& rhs)
         {
-                // seed the hash with ASLR and some random bits
-                return std::hash<T>{}(val) ^ (reinterpret_cast<size_t>(this->__get_mem()) >> 12)
-                                             ^ 0xf58e33ad9e13e5c1;
-                // last part from https://www.random.org/cgi-bin/randbyte?nbytes=8&format=h
-                // (you won't get the same result, read the url...)
+                swap(rhs);
+                return *this;
         }
-        
-        double __size_load() const
+
+        // xxx: copies would be easy enough, nobody's needed one yet
+        frozen_hash_set(const frozen_hash_set&) = delete;
+        frozen_hash_set& operator=(const frozen_hash_set&) = delete;
+
+        ~frozen_hash_set()
         {
-                return size_/double(this->capacity_);
+                value_alloc_t a(alloc_);
+                for (size_t i = 0; i < size_; ++i) {
+                        value_traits::destroy(a, data_ + i);
+                }
+                if (raw_) {
+                        byte_traits::deallocate(alloc_, raw_, raw_size_);
+                }
         }
 
-public:
+        const_iterator find(const key_type& key) const
+        {
+                const size_t hash = __seed_hash(hash_(key));
+                const size_t g = __fastrange(hash, groups_);
+                const T * p = __find_in(key, hash, g);
+                if (p || !(offsets_[g] & __spilled)) {
+                        return p ? p : end();
+                }
+                p = __find_in(key, hash, __second_group(hash, g, groups_));
+                return p ? p : end();
+        }
+
+        bool contains(const key_type& key) const
+        {
+                return find(key) != end();
+        }
+
+        size_t count(const key_type& key) const
+        {
+                return contains(key) ? 1 : 0;
+        }
+
+        // elements come out grouped by where they hash, not in the order they went in
+        const_iterator begin() const
+        {
+                return data_;
+        }
+
+        const_iterator end() const
+        {
+                return data_ + size_;
+        }
+
+        size_t size() const
+        {
+                return size_;
+        }
+
+        bool empty() const
+        {
+                return size_ == 0;
+        }
+
+        // everything this set allocated, metadata included
+        size_t bytes() const
+        {
+                return raw_size_;
+        }
+
+        // fraction of the metadata slots in use
         double load() const
         {
-                return tombstones_/double(this->capacity_);
+                return size_ / double(groups_ * W);
         }
 
-        void swap(hash_set & rhs)
+        void swap(frozen_hash_set& rhs)
         {
-                base_t::swap(rhs);
+                using std::swap;
+                swap(hash_, rhs.hash_);
+                swap(eq_, rhs.eq_);
+                swap(alloc_, rhs.alloc_);
+                std::swap(raw_, rhs.raw_);
+                std::swap(raw_size_, rhs.raw_size_);
+                std::swap(meta_, rhs.meta_);
+                std::swap(offsets_, rhs.offsets_);
+                std::swap(data_, rhs.data_);
+                std::swap(groups_, rhs.groups_);
                 std::swap(size_, rhs.size_);
-                std::swap(tombstones_, rhs.tombstones_);
+                std::swap(seed_, rhs.seed_);
         }
 
-        friend std::ostream& operator<<(std::ostream& os, const hash_set& set)
+private:
+        size_t __seed_hash(size_t user_hash) const
         {
-                meta * mvec = set.get_meta();
-                for (size_t i = 0; i < set.capacity(); ++i) {
-                        os << std::hex << std::setfill('0') << std::setw(2)
-                           << int(mvec[i].m_);
+                return __hash_mix(user_hash ^ seed_);
+        }
 
-                        if (i != set.capacity() - 1) {
-                                os << " ";
+        // the other group a key with this hash can go in. Never the same as its first.
+        static size_t __second_group(size_t hash, size_t first, size_t groups)
+        {
+                const size_t g = __fastrange(__hash_mix(hash), groups);
+                return g != first ? g : (first + 1 == groups ? 0 : first + 1);
+        }
+
+        const T * __find_in(const key_type& key, size_t hash, size_t g) const
+        {
+                uint64_t bitmap = group::match(meta_ + g * W, 0x80 | (hash & 0x7f));
+                const T * base = data_ + (offsets_[g] & ~__spilled);
+                while (bitmap != 0) {
+                        const size_t i = __builtin_ctzll(bitmap);
+                        if (eq_(key, base[i])) {
+                                return base + i;
                         }
+                        bitmap &= bitmap - 1;
                 }
-                return os;
+                return nullptr;
         }
-};
 
-template <typename T>
-void swap(hash_set<T> & lhs, hash_set<T> & rhs)
-{
-        lhs.swap(rhs);
-}
+        // Try to fit every key into groups groups with this seed. On success group[i] is where
+        // key i goes, with __spilled set if that's its second group, and fill has each group's
+        // count.
+        bool __place(const std::vector<size_t>& user_hashes, size_t groups, size_t seed,
+                     std::vector<uint32_t>& group, std::vector<uint32_t>& fill) const
+        {
+                const size_t n = user_hashes.size();
+                std::vector<size_t> hash(n);
+                for (size_t i = 0; i < n; ++i) {
+                        hash[i] = __hash_mix(user_hashes[i] ^ seed);
+                }
+
+                // Keys by first group, and by hash within one, so who gets in first doesn't
+                // depend on the order the range came in. by_first[start[g]..start[g+1]) is
+                // everything whose first group is g.
+                std::vector<uint32_t> by_first(n);
+                std::iota(by_first.begin(), by_first.end(), 0);
+                std::sort(by_first.begin(), by_first.end(), [&](uint32_t a, uint32_t b) {
+                        return hash[a] < hash[b];
+                });
+                std::vector<uint32_t> start(groups + 1, 0);
+                for (size_t i = 0; i < n; ++i) {
+                        ++start[__fastrange(hash[i], groups) + 1];
+                }
+                for (size_t g = 0; g < groups; ++g) {
+                        start[g + 1] += start[g];
+                }
+
+                // everything that fits in its first group goes there before anything spills, so
+                // spills only take room nobody else wanted first. fastrange keeps hash order in
+                // group order, so by_first is already grouped.
+                fill.assign(groups, 0);
+                std::vector<uint32_t> spilled;
+                for (uint32_t i : by_first) {
+                        const size_t g = __fastrange(hash[i], groups);
+                        if (fill[g] < W) {
+                                group[i] = g;
+                                ++fill[g];
+                        } else {
+                                spilled.push_back(i);
+                        }
+                }
+
+                for (uint32_t i : spilled) {
+                        const size_t g = __second_group(hash[i], __fastrange(hash[i], groups),
+                                                        groups);
+                        if (fill[g] == W && !__make_room(hash, by_first, start, g, group, fill)) {
+                                return false;
+                        }
+                        group[i] = g | __spilled;
+                        ++fill[g];
+                }
+                return true;
+        }
+
+        // Group g is full: move one key that's in g as its first group over to its second, if
+        // that has room. One step is enough to place nearly everything at __target_per_group.
+        bool __make_room(const std::vector<size_t>& hash, const std::vector<uint32_t>& by_first,
+                         const std::vector<uint32_t>& start, size_t g,
+                         std::vector<uint32_t>& group, std::vector<uint32_t>& fill) const
+        {
+                const size_t groups = fill.size();
+                for (size_t k = start[g]; k < start[g + 1]; ++k) {
+                        const uint32_t j = by_first[k];
+                        if (group[j] != g) {
+                                continue; // spilled, or already moved
+                        }
+                        const size_t other = __second_group(hash[j], g, groups);
+                        if (fill[other] < W) {
+                                group[j] = other | __spilled;
+                                ++fill[other];
+                                --fill[g];
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        template <typename Set>
+        void __build(const Set& uniq)
+        {
+                size_ = uniq.size();
+                if (size_ == 0) {
+                        return;
+                }
+                if (size_ >= __spilled) {
+                        throw std::length_error{"frozen_hash_set: too many elements"};
+                }
+
+                std::vector<const T *> keys;
+                std::vector<size_t> user_hashes;
+                keys.reserve(size_);
+                user_hashes.reserve(size_);
+                for (const T& v : uniq) {
+                        keys.push_back(&v);
+                        user_hashes.push_back(hash_(v));
+                }
+
+                std::vector<uint32_t> group(size_);
+                std::vector<uint32_t> fill;
+                size_t groups = (size_ + __target_per_group - 1) / __target_per_group;
+                for (size_t attempt = 0; ; ++attempt) {
+                        // a few seeds at each size, then give the keys a bit more room
+                        if (attempt != 0 && attempt % __seeds_per_size == 0) {
+                                groups += groups / 8 + 1;
+                        }
+                        // Past a group per key, more room won't help: the hash puts too many
+                        // keys in the same two groups no matter the seed.
+                        if (groups > size_ + 1) {
+                                throw std::invalid_argument{
+                                        "frozen_hash_set: too many keys share a hash"};
+                        }
+                        seed_ = __hash_mix(attempt + 1);
+                        if (__place(user_hashes, groups, seed_, group, fill)) {
+                                break;
+                        }
+                }
+                groups_ = groups;
+
+                // one block: metadata, then group offsets, then the elements
+                const size_t meta_bytes = groups_ * W;
+                const size_t data_off = (meta_bytes + groups_ * sizeof(uint32_t) + alignof(T) - 1)
+                        & ~(alignof(T) - 1);
+                const size_t align = alignof(T) > W ? alignof(T) : W;
+                raw_size_ = data_off + size_ * sizeof(T) + align - 1;
+                raw_ = &*byte_traits::allocate(alloc_, raw_size_);
+                const uintptr_t base = (reinterpret_cast<uintptr_t>(raw_) + align - 1)
+                        & ~uintptr_t{align - 1};
+                uint8_t * meta = reinterpret_cast<uint8_t *>(base);
+                uint32_t * offsets = reinterpret_cast<uint32_t *>(base + meta_bytes);
+                T * data = reinterpret_cast<T *>(base + data_off);
+
+                memset(meta, 0, meta_bytes);
+                uint32_t start = 0;
+                for (size_t g = 0; g < groups_; ++g) {
+                        offsets[g] = start;
+                        start += fill[g];
+                        fill[g] = 0; // now counts what's been put in so far
+                }
+
+                value_alloc_t a(alloc_);
+                try {
+                        for (size_t i = 0; i < size_; ++i) {
+                                const size_t hash = __seed_hash(user_hashes[i]);
+                                const size_t g = group[i] & ~__spilled;
+                                if (group[i] & __spilled) {
+                                        offsets[__fastrange(hash, groups_)] |= __spilled;
+                                }
+                                const size_t pos = fill[g];
+                                value_traits::construct(a, data + (offsets[g] & ~__spilled) + pos,
+                                                        *keys[i]);
+                                meta[g * W + pos] = 0x80 | (hash & 0x7f);
+                                ++fill[g];
+                        }
+                } catch (...) {
+                        // elements go in by group, not in i order, so fill says what got built
+                        for (size_t g = 0; g < groups_; ++g) {
+                                T * first = data + (offsets[g] & ~__spilled);
+                                for (size_t pos = 0; pos < fill[g]; ++pos) {
+                                        value_traits::destroy(a, first + pos);
+                                }
+                        }
+                        byte_traits::deallocate(alloc_, raw_, raw_size_);
+                        raw_ = nullptr;
+                        throw;
+                }
+
+                meta_ = meta;
+                offsets_ = offsets;
+                data_ = data;
+        }
+};
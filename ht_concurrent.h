@@ -0,0 +1,605 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <new>
+#include <memory>
+
+#include "ht.h"
+
+// Spinlock that's just a byte. Test and test-and-set so waiters spin on a shared cache line instead
+// of hammering it with writes, and back off to the scheduler if the holder isn't letting go (for
+// when there are more threads than cores).
+class __spinlock
+{
+        std::atomic<bool> locked_{false};
+
+public:
+        void lock()
+        {
+                for (unsigned spins = 0; ; ++spins) {
+                        if (!locked_.exchange(true, std::memory_order_acquire)) {
+                                return;
+                        }
+                        while (locked_.load(std::memory_order_relaxed)) {
+                                if (spins++ > 64) {
+                                        std::this_thread::yield();
+                                } else {
+#ifdef HT_X86
+                                        _mm_pause();
+#endif
+                                }
+                        }
+                }
+        }
+
+        void unlock()
+        {
+                locked_.store(false, std::memory_order_release);
+        }
+};
+
+// hash_set split into a power of two number of shards, each with its own lock. A key's shard
+// comes from the top bits of its mixed hash, which is the opposite end from what the shard's own
+// hash_set uses to place it. Every shard grows on its own, so one resize only ever blocks the
+// keys that live in that shard.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+class concurrent_hash_set
+{
+public:
+        using set_type = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth>;
+        using key_type = T;
+        using value_type = T;
+
+private:
+        // each shard gets its own cache lines so threads working on neighbouring shards don't
+        // fight over them
+        struct alignas(64) shard {
+                __spinlock lock;
+                set_type set;
+
+                shard(size_t capacity, const Hash& hash, const KeyEqual& eq, const Allocator& alloc)
+                        : set{capacity, hash, eq, alloc}
+                {}
+        };
+
+        Hash hash_;
+        unsigned shard_bits_;
+        shard * shards_;
+
+        static unsigned sanitize_shard_bits(size_t shards)
+        {
+                unsigned bits = 0;
+                while ((size_t{1} << bits) < shards && bits < 16) {
+                        ++bits;
+                }
+                return bits;
+        }
+
+        // Shards hand out their locks even from const members, so this is non-const either way.
+        // hash is hash_(key), which the shard's set then takes as is instead of hashing again.
+        shard& shard_for(size_t hash) const
+        {
+                if (shard_bits_ == 0) {
+                        return shards_[0];
+                }
+                return shards_[__hash_mix(hash) >> (64 - shard_bits_)];
+        }
+
+public:
+        // shards is rounded up to a power of two, capacity is spread evenly over them
+        explicit concurrent_hash_set(size_t shards = 64, size_t capacity = 0,
+                                     const Hash& hash = Hash(), const KeyEqual& eq = KeyEqual(),
+                                     const Allocator& alloc = Allocator())
+                : hash_(hash), shard_bits_(sanitize_shard_bits(shards))
+        {
+                const size_t n = shard_count();
+                shards_ = static_cast<shard *>(::operator new(n * sizeof(shard),
+                                                              std::align_val_t{alignof(shard)}));
+                for (size_t i = 0; i < n; ++i) {
+                        new (shards_ + i) shard(capacity / n, hash, eq, alloc);
+                }
+        }
+
+        ~concurrent_hash_set()
+        {
+                for (size_t i = 0; i < shard_count(); ++i) {
+                        shards_[i].~shard();
+                }
+                ::operator delete(shards_, std::align_val_t{alignof(shard)});
+        }
+
+        concurrent_hash_set(const concurrent_hash_set&) = delete;
+        concurrent_hash_set& operator=(const concurrent_hash_set&) = delete;
+
+        size_t shard_count() const
+        {
+                return size_t{1} << shard_bits_;
+        }
+
+        // true if val wasn't there before
+        bool insert(const T& val)
+        {
+                const size_t h = hash_(val);
+                shard& s = shard_for(h);
+                std::lock_guard<__spinlock> guard{s.lock};
+                return s.set.insert(val, h).second;
+        }
+
+        bool insert(T&& val)
+        {
+                const size_t h = hash_(val);
+                shard& s = shard_for(h);
+                std::lock_guard<__spinlock> guard{s.lock};
+                return s.set.insert(std::move(val), h).second;
+        }
+
+        bool contains(const key_type& key) const
+        {
+                const size_t h = hash_(key);
+                shard& s = shard_for(h);
+                std::lock_guard<__spinlock> guard{s.lock};
+                return s.set.find(key, h) != s.set.end();
+        }
+
+        // true if key was there
+        bool erase(const key_type& key)
+        {
+                const size_t h = hash_(key);
+                shard& s = shard_for(h);
+                std::lock_guard<__spinlock> guard{s.lock};
+                const size_t before = s.set.size();
+                s.set.erase(key, h);
+                return s.set.size() != before;
+        }
+
+        // Only exact if nobody else is writing. Shards are counted one at a time.
+        size_t size() const
+        {
+                size_t total = 0;
+                for (size_t i = 0; i < shard_count(); ++i) {
+                        shard& s = shards_[i];
+                        std::lock_guard<__spinlock> guard{s.lock};
+                        total += s.set.size();
+                }
+                return total;
+        }
+
+        // Call f on every element, holding one shard's lock at a time. f must not touch this set.
+        template <typename F>
+        void for_each(F&& f) const
+        {
+                for (size_t i = 0; i < shard_count(); ++i) {
+                        shard& s = shards_[i];
+                        std::lock_guard<__spinlock> guard{s.lock};
+                        for (const auto& v : s.set) {
+                                f(v);
+                        }
+                }
+        }
+};
+
+// Fixed capacity set that threads can insert into and search concurrently without any locks, for
+// "have we seen this before" filters that never erase. Same metadata layout as hash_set, except
+// for a transient busy state:
+//
+//     0x00 -> 0x40 | 5 hash bits    claim the slot with a CAS
+//          -> 0x80 | 7 hash bits    construct the element, then publish with a release store
+//
+// Readers scan groups exactly like hash_set does and do an acquire load on any byte they match
+// before touching its slot. An insert only has to wait on a busy slot that might be its own key
+// being inserted by someone else, which the 5 hash bits in the busy byte make rare. If two threads
+// race to insert the same value, one of them loses and turns its slot into a tombstone.
+//
+// xxx: the group scans are plain (non-atomic) vector loads of bytes other threads CAS. That's fine
+// on x86, where aligned loads see each byte either before or after a store, but it is a data race
+// as far as the C++ memory model (and tsan) is concerned.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+class lockfree_hash_set : hash_set_mem<T, GroupWidth, Allocator>
+{
+        using base_t = hash_set_mem<T, GroupWidth, Allocator>;
+        using meta = typename base_t::meta;
+        using group = __group<GroupWidth>;
+        static constexpr size_t W = GroupWidth;
+
+        Hash hash_;
+        KeyEqual eq_;
+        std::atomic<size_t> size_{0};
+
+        // room for n elements at 7/8 load, so probes always have somewhere to stop
+        static size_t sanitize_capacity(size_t n)
+        {
+                size_t want = n + n / 7 + 1;
+                size_t cap = W;
+                while (cap < want) {
+                        cap *= 2;
+                }
+                return cap;
+        }
+
+        size_t do_hash(const T& key) const
+        {
+                // fixed capacity, so the buffer (and the seed) never moves
+                return __hash_mix(hash_(key) ^ (reinterpret_cast<size_t>(this->__get_mem()) >> 12)
+                                             ^ 0xf58e33ad9e13e5c1);
+        }
+
+        // whoever we're waiting on might not even be running (more threads than cores), so
+        // don't just burn the rest of our time slice
+        static void __relax()
+        {
+#ifdef HT_X86
+                _mm_pause();
+#endif
+                std::this_thread::yield();
+        }
+
+        static uint8_t busy_byte(size_t hash)
+        {
+                return 0x40 | (hash & 0x1f);
+        }
+
+        static uint8_t occupied_byte(size_t hash)
+        {
+                return 0x80 | (hash & 0x7f);
+        }
+
+        uint8_t load_meta(size_t idx) const
+        {
+                return __atomic_load_n(&this->get_meta()[idx].m_, __ATOMIC_ACQUIRE);
+        }
+
+        // any published slot in this group (limited to the slots in mask) holding key?
+        bool group_has(const T& key, size_t hash, size_t i, uint64_t mask) const
+        {
+                uint64_t bitmap = group::match(this->get_meta() + i, occupied_byte(hash)) & mask;
+                while (bitmap != 0) {
+                        const size_t idx = i + __builtin_ctzll(bitmap);
+                        if (load_meta(idx) == occupied_byte(hash)
+                            && eq_(key, this->get_data()[idx])) {
+                                return true;
+                        }
+                        bitmap &= bitmap - 1;
+                }
+                return false;
+        }
+
+public:
+        // capacity is how many elements this will ever hold
+        explicit lockfree_hash_set(size_t capacity, const Hash& hash = Hash(),
+                                   const KeyEqual& eq = KeyEqual(),
+                                   const Allocator& alloc = Allocator())
+                : base_t(sanitize_capacity(capacity), alloc), hash_(hash), eq_(eq)
+        {}
+
+        lockfree_hash_set(const lockfree_hash_set&) = delete;
+        lockfree_hash_set& operator=(const lockfree_hash_set&) = delete;
+
+        size_t capacity() const
+        {
+                return this->capacity_;
+        }
+
+        size_t size() const
+        {
+                return size_.load(std::memory_order_relaxed);
+        }
+
+        bool contains(const T& key) const
+        {
+                const size_t hash = do_hash(key);
+                const size_t start = ((hash >> 7) % this->capacity_) & ~(W - 1);
+                size_t i = start;
+                do {
+                        if (group_has(key, hash, i, group::all)) {
+                                return true;
+                        }
+                        if (group::match_empty(this->get_meta() + i)) {
+                                return false;
+                        }
+                        i = (i + W) % this->capacity_;
+                } while (i != start);
+                return false;
+        }
+
+        // True if this call added val. Throws std::length_error if the table is full.
+        //
+        // Slots in a group are always claimed lowest empty first, and never go back to empty, so
+        // everything below the slot we claim was claimed before us. That means a racing insert of
+        // the same value is either below us, where we wait for it to publish and then compare, or
+        // above us, where it does the same to us. Nobody ever waits on a slot above their own, so
+        // there's no cycle. The loser of a race leaves its slot as a tombstone.
+        template <typename U>
+        bool insert(U&& val)
+        {
+                const size_t hash = do_hash(val);
+                const size_t start = ((hash >> 7) % this->capacity_) & ~(W - 1);
+                meta * mvec = this->get_meta();
+                size_t i = start;
+
+                do {
+                        for (;;) {
+                                // someone else might be halfway through inserting val right here
+                                if (group::match(mvec + i, busy_byte(hash)) != 0) {
+                                        __relax();
+                                        continue;
+                                }
+
+                                if (group_has(val, hash, i, group::all)) {
+                                        return false;
+                                }
+
+                                const uint64_t empty = group::match_empty(mvec + i);
+                                if (empty == 0) {
+                                        // Someone may have claimed the last empty slot since we
+                                        // looked, maybe for val. Nothing can claim anything here
+                                        // now, so once they're done this look is final.
+                                        while (group::match(mvec + i, busy_byte(hash)) != 0) {
+                                                __relax();
+                                        }
+                                        if (group_has(val, hash, i, group::all)) {
+                                                return false;
+                                        }
+                                        break;
+                                }
+
+                                const int bit = __builtin_ctzll(empty);
+                                const size_t idx = i + bit;
+                                uint8_t expected = 0x00;
+                                if (!__atomic_compare_exchange_n(&mvec[idx].m_, &expected,
+                                                                 busy_byte(hash), false,
+                                                                 __ATOMIC_SEQ_CST,
+                                                                 __ATOMIC_SEQ_CST)) {
+                                        // lost the race for that slot, look at the group again
+                                        continue;
+                                }
+
+                                const uint64_t below = (uint64_t{1} << bit) - 1;
+                                while (group::match(mvec + i, busy_byte(hash)) & below) {
+                                        __relax();
+                                }
+
+                                if (group_has(val, hash, i, below)) {
+                                        __atomic_store_n(&mvec[idx].m_, 0x01, __ATOMIC_RELEASE);
+                                        return false;
+                                }
+
+                                this->construct(this->get_data() + idx, std::forward<U>(val));
+                                __atomic_store_n(&mvec[idx].m_, occupied_byte(hash),
+                                                 __ATOMIC_RELEASE);
+                                size_.fetch_add(1, std::memory_order_relaxed);
+                                return true;
+                        }
+
+                        i = (i + W) % this->capacity_;
+                } while (i != start);
+
+                throw std::length_error{"lockfree_hash_set is full"};
+        }
+
+        // Call f on every published element. Elements inserted during the walk may or may not
+        // be seen.
+        template <typename F>
+        void for_each(F&& f) const
+        {
+                for (size_t i = 0; i < this->capacity_; ++i) {
+                        if (meta{load_meta(i)}.is_occupied()) {
+                                f(this->get_data()[i]);
+                        }
+                }
+        }
+};
+
+// Read-copy-update wrapper for read-mostly sets. The current table is an immutable hash_set behind
+// an atomic pointer. Readers look things up in it with nothing but a store to their own cache line
+// to say which epoch they're reading in. Writers take a lock, copy the table, change the copy and
+// swap it in; the old table is freed once every reader that might still be looking at it has moved
+// on (epoch based reclamation).
+//
+// Each reading thread needs a reader handle, which owns one of a fixed number of reader slots.
+template <typename T, typename Hash = ht_hash<T>, typename KeyEqual = std::equal_to<T>,
+          typename Allocator = std::allocator<T>, size_t GroupWidth = 16>
+class rcu_hash_set
+{
+public:
+        using set_type = hash_set<T, Hash, KeyEqual, Allocator, GroupWidth>;
+        using key_type = T;
+        using value_type = T;
+
+private:
+        static constexpr uint64_t idle = ~uint64_t{0};
+
+        struct alignas(64) reader_slot {
+                std::atomic<uint64_t> epoch{idle};
+                std::atomic<bool> in_use{false};
+        };
+
+        struct retired {
+                const set_type * set;
+                uint64_t epoch;
+        };
+
+        std::atomic<const set_type *> current_;
+        std::atomic<uint64_t> epoch_{0};
+        size_t max_readers_;
+        std::unique_ptr<reader_slot[]> slots_;
+
+        std::mutex write_lock_;
+        std::vector<retired> retired_;
+
+        // with write_lock_ held: free everything no reader can still see
+        void reclaim()
+        {
+                uint64_t oldest = idle;
+                for (size_t i = 0; i < max_readers_; ++i) {
+                        oldest = std::min(oldest, slots_[i].epoch.load(std::memory_order_seq_cst));
+                }
+
+                auto live = std::remove_if(retired_.begin(), retired_.end(), [&](const retired& r) {
+                        if (r.epoch < oldest) {
+                                delete r.set;
+                                return true;
+                        }
+                        return false;
+                });
+                retired_.erase(live, retired_.end());
+        }
+
+        // with write_lock_ held
+        void publish(const set_type * next)
+        {
+                const set_type * old = current_.exchange(next, std::memory_order_seq_cst);
+                // anyone who announces the new epoch read the pointer after the exchange, so
+                // only readers at this epoch or older can have old
+                const uint64_t e = epoch_.fetch_add(1, std::memory_order_seq_cst);
+                retired_.push_back(retired{old, e});
+                reclaim();
+        }
+
+public:
+        // A pinned snapshot. The table it points at stays alive (and unchanged) until this goes
+        // away. Don't hold on to it for long, it holds up reclamation.
+        class guard
+        {
+                reader_slot * slot_;
+                const set_type * set_;
+
+                friend class rcu_hash_set;
+
+                guard(reader_slot * slot, const set_type * set) : slot_{slot}, set_{set}
+                {}
+
+        public:
+                guard(guard&& rhs) : slot_{rhs.slot_}, set_{rhs.set_}
+                {
+                        rhs.slot_ = nullptr;
+                }
+
+                guard(const guard&) = delete;
+                guard& operator=(const guard&) = delete;
+
+                ~guard()
+                {
+                        if (slot_) {
+                                slot_->epoch.store(idle, std::memory_order_release);
+                        }
+                }
+
+                const set_type& operator*() const
+                {
+                        return *set_;
+                }
+
+                const set_type * operator->() const
+                {
+                        return set_;
+                }
+        };
+
+        // One per reading thread. Not thread safe itself, and must not outlive the set.
+        class reader
+        {
+                rcu_hash_set * parent_;
+                reader_slot * slot_;
+
+                friend class rcu_hash_set;
+
+                reader(rcu_hash_set * parent, reader_slot * slot) : parent_{parent}, slot_{slot}
+                {}
+
+        public:
+                reader(reader&& rhs) : parent_{rhs.parent_}, slot_{rhs.slot_}
+                {
+                        rhs.slot_ = nullptr;
+                }
+
+                reader(const reader&) = delete;
+                reader& operator=(const reader&) = delete;
+
+                ~reader()
+                {
+                        if (slot_) {
+                                slot_->in_use.store(false, std::memory_order_release);
+                        }
+                }
+
+                // one snapshot at a time per reader
+                guard lock()
+                {
+                        assert(slot_->epoch.load(std::memory_order_relaxed) == idle);
+                        const uint64_t e = parent_->epoch_.load(std::memory_order_acquire);
+                        slot_->epoch.store(e, std::memory_order_seq_cst);
+                        return guard{slot_, parent_->current_.load(std::memory_order_seq_cst)};
+                }
+
+                bool contains(const key_type& key)
+                {
+                        guard g = lock();
+                        return g->find(key) != g->end();
+                }
+        };
+
+        // Takes ownership of initial, even if this throws.
+        explicit rcu_hash_set(size_t max_readers = 64, set_type * initial = nullptr)
+                : current_{nullptr}, max_readers_{max_readers}
+        {
+                std::unique_ptr<set_type> first{initial};
+                slots_.reset(new reader_slot[max_readers_]);
+                current_.store(first ? first.release() : new set_type);
+        }
+
+        // No readers may be active.
+        ~rcu_hash_set()
+        {
+                for (const auto& r : retired_) {
+                        delete r.set;
+                }
+                delete current_.load();
+        }
+
+        rcu_hash_set(const rcu_hash_set&) = delete;
+        rcu_hash_set& operator=(const rcu_hash_set&) = delete;
+
+        // Throws std::length_error if all max_readers slots are taken.
+        reader make_reader()
+        {
+                for (size_t i = 0; i < max_readers_; ++i) {
+                        bool expected = false;
+                        if (slots_[i].in_use.compare_exchange_strong(expected, true)) {
+                                return reader{this, slots_.get() + i};
+                        }
+                }
+                throw std::length_error{"rcu_hash_set is out of reader slots"};
+        }
+
+        // Copy the current table, let f change the copy, and publish it. Writers are serialized.
+        template <typename F>
+        void update(F&& f)
+        {
+                std::lock_guard<std::mutex> lk{write_lock_};
+                const set_type * cur = current_.load(std::memory_order_relaxed);
+
+                set_type * next = new set_type{*cur};
+                f(*next);
+                publish(next);
+        }
+
+        // Swap in a table built elsewhere.
+        void replace(set_type * next)
+        {
+                std::lock_guard<std::mutex> lk{write_lock_};
+                publish(next);
+        }
+
+        // Number of old tables still waiting for readers to move on.
+        size_t pending_reclaim()
+        {
+                std::lock_guard<std::mutex> lk{write_lock_};
+                reclaim();
+                return retired_.size();
+        }
+};
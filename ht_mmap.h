@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ht.h"
+
+// Read-only view of a snapshot written by hash_table::save(), straight off the mapped pages.
+// Opening it is an mmap plus a look at the header; lookups and iteration run on the file's bytes,
+// and pages get read in as lookups touch them. Set is the hash_set (or hash_map) type that wrote
+// the file, and the Hash it gets constructed with has to hash the same way the writer's did.
+template <typename Set>
+class mapped_hash_set
+{
+public:
+        using set_type = Set;
+        using key_type = typename Set::key_type;
+        using value_type = typename Set::value_type;
+        using hasher = typename Set::hasher;
+        using key_equal = typename Set::key_equal;
+        using const_iterator = typename Set::const_iterator;
+
+        // verify reads the whole file to check the checksum, which is still a lot cheaper than
+        // rebuilding, but isn't free for big files
+        explicit mapped_hash_set(const char * path, bool verify = false,
+                                 const hasher& hash = hasher(), const key_equal& eq = key_equal())
+                : map_{__map(path)},
+                  set_{typename Set::__external_tag{}, __block(), __header(path, verify), hash, eq}
+        {}
+
+        ~mapped_hash_set()
+        {
+                if (map_.first) {
+                        munmap(map_.first, map_.second);
+                }
+        }
+
+        mapped_hash_set(const mapped_hash_set&) = delete;
+        mapped_hash_set& operator=(const mapped_hash_set&) = delete;
+
+        const_iterator find(const key_type& key) const
+        {
+                return set_.find(key);
+        }
+
+        bool contains(const key_type& key) const
+        {
+                return set_.contains(key);
+        }
+
+        size_t count(const key_type& key) const
+        {
+                return set_.count(key);
+        }
+
+        const_iterator begin() const
+        {
+                return set_.begin();
+        }
+
+        const_iterator end() const
+        {
+                return set_.end();
+        }
+
+        size_t size() const
+        {
+                return set_.size();
+        }
+
+        size_t capacity() const
+        {
+                return set_.capacity();
+        }
+
+        // the whole thing as a normal (read-only) set, for anything not forwarded above
+        const Set& set() const
+        {
+                return set_;
+        }
+
+private:
+        // address and length of the mapping. Declared before set_ so it's mapped by the time set_
+        // gets built, and still mapped while set_ goes away.
+        std::pair<void *, size_t> map_;
+        const Set set_;
+
+        [[noreturn]] static void __fail(const char * path, const std::string& why)
+        {
+                throw std::runtime_error{std::string{"mapped_hash_set: "} + path + ": " + why};
+        }
+
+        static std::pair<void *, size_t> __map(const char * path)
+        {
+                const int fd = open(path, O_RDONLY);
+                if (fd < 0) {
+                        __fail(path, strerror(errno));
+                }
+
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                        const int err = errno;
+                        close(fd);
+                        __fail(path, strerror(err));
+                }
+
+                const size_t len = st.st_size;
+                if (len < sizeof(__ht_file_header)) {
+                        close(fd);
+                        __fail(path, "too short for a header");
+                }
+
+                void * p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+                const int err = errno;
+                // the mapping keeps the file alive on its own
+                close(fd);
+                if (p == MAP_FAILED) {
+                        __fail(path, strerror(err));
+                }
+                return {p, len};
+        }
+
+        const void * __block() const
+        {
+                return static_cast<const uint8_t *>(map_.first) + sizeof(__ht_file_header);
+        }
+
+        // Check that the file is something Set can use as is. Throws (after unmapping) if not.
+        const __ht_file_header& __header(const char * path, bool verify)
+        {
+                const __ht_file_header& h = *static_cast<const __ht_file_header *>(map_.first);
+                const size_t block = map_.second - sizeof(h);
+                const char * why = nullptr;
+
+                if (memcmp(h.magic, __ht_file_magic, sizeof(h.magic)) != 0) {
+                        why = "not a hash_table snapshot";
+                } else if (h.version != __ht_file_version) {
+                        why = "unsupported version";
+                } else if (h.group_width != Set::__group_width || h.slot_size != Set::__slot_size
+                           || h.probing != Set::__probing_id) {
+                        why = "written by a different kind of table";
+                } else if (!Set::__valid_capacity(h.capacity) || h.size > h.tombstones
+                           || h.tombstones > h.capacity) {
+                        // before anything works out sizes from capacity
+                        why = "corrupt header";
+                } else if (block != Set::__mem_size_for(h.capacity)) {
+                        why = "size doesn't match the header";
+                } else if (h.capacity != 0
+                           && static_cast<const uint8_t *>(__block())[h.capacity] != 0x7f) {
+                        // without it, iteration would run off the end of the metadata
+                        why = "missing end byte";
+                } else if (verify && h.capacity != 0 && hash_bytes(__block(), block) != h.checksum) {
+                        why = "checksum mismatch";
+                }
+
+                if (why) {
+                        munmap(map_.first, map_.second);
+                        map_.first = nullptr;
+                        __fail(path, why);
+                }
+                return h;
+        }
+};